@@ -1,22 +1,699 @@
 #include "tsub.h"
-#include <cerrno>
 #include <cstdlib>
 #include <cstdarg>
 #include <sstream>
 #include <cstdio>
+#include <cstring>
+#include <climits>
+#include <limits>
+#include <map>
 #include <set>
+#include <list>
+#include <algorithm>
+
+// Literal text is scanned 16 or 32 bytes at a time when the target has SSE2
+// or AVX2 , define TSUB_NO_SIMD to always use the plain loop
+#if !defined(TSUB_NO_SIMD) && defined(__GNUC__)
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TSUB_SSE2
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TSUB_AVX2
+#endif
+#endif // TSUB_NO_SIMD
+
+#if TSUB_HAS_THREADS
+#include <thread>
+#include <mutex>
+#include <atomic>
+#endif // TSUB_HAS_THREADS
 
 #define UNREACHABLE(X) do { assert(0&&"Unreachable"); X; } while(0)
 
 namespace {
 
-// String as array function. Ugly hack to get the internal buffer of that
-// std::string object. This one _may_ portable , this is because Chrome uses
-// a similar trick to do so in its base/stl_helper.h file (may not correct).
+// Reference to a piece of string that is owned by someone else. It is a
+// poor man's string_view since we stick to C++03.
+struct StringPiece {
+    const char* data;
+    std::size_t size;
+
+    StringPiece():
+        data(NULL),
+        size(0)
+        {}
+
+    StringPiece( const char* d , std::size_t s ):
+        data(d),
+        size(s)
+        {}
+
+    explicit StringPiece( const std::string& str ):
+        data(str.data()),
+        size(str.size())
+        {}
+};
+
+// Interning pool for the strings that are generated during the expansion.
+// The bytes live in big arena blocks and are found through an open
+// addressing hash table , so interning a string costs neither a heap
+// allocation per string nor a tree walk with string comparison.
+class StringPool {
+public:
+    StringPool():
+        count_(0),
+        block_used_(0) {
+            table_.resize(kInitTableSize);
+        }
+
+    ~StringPool() {
+        for( std::size_t i = 0 ; i < block_.size() ; ++i )
+            delete [] block_[i].data;
+    }
+
+    StringPiece Intern( const char* data , std::size_t size );
+
+    StringPiece Intern( const std::string& str ) {
+        return Intern(str.data(),str.size());
+    }
+
+    // Copy the string into the pool without interning , for strings that
+    // are known to be cheap to keep duplicated , like the numbers
+    StringPiece Store( const char* data , std::size_t size ) {
+        return StringPiece(Copy(data,size),size);
+    }
+
+    StringPiece Store( const StringPiece& str ) {
+        return Store(str.data,str.size);
+    }
+
+    // Forget all the strings but keep the memory , so the pool can be
+    // reused by the next expansion
+    void Clear();
+
+    // Exchange the content with another pool , the strings stay in place
+    void Swap( StringPool* pool ) {
+        table_.swap(pool->table_);
+        block_.swap(pool->block_);
+        std::swap(count_,pool->count_);
+        std::swap(block_used_,pool->block_used_);
+    }
+
+private:
+    static const std::size_t kInitTableSize = 64;
+    static const std::size_t kBlockSize = 64*1024;
+
+    struct Slot {
+        const char* data;
+        std::size_t size;
+        unsigned int hash;
+
+        Slot():
+            data(NULL),
+            size(0),
+            hash(0)
+            {}
+    };
+
+    struct Block {
+        char* data;
+        std::size_t size;
+    };
+
+    static unsigned int Hash( const char* data , std::size_t size ) {
+        // FNV-1a
+        unsigned int hash = 2166136261U;
+        for( std::size_t i = 0 ; i < size ; ++i ) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 16777619U;
+        }
+        return hash;
+    }
+
+    const char* Copy( const char* data , std::size_t size );
+    void NewBlock();
+    void Rehash();
+
+private:
+    // Hash table , size is always power of 2 and at most half full
+    std::vector<Slot> table_;
+    std::size_t count_;
+
+    // Arena blocks , only the last one is used for new allocation
+    std::vector<Block> block_;
+    std::size_t block_used_;
+
+    StringPool( const StringPool& );
+    StringPool& operator = ( const StringPool& );
+};
+
+void StringPool::NewBlock() {
+    Block block;
+    block.data = new char[kBlockSize];
+    block.size = kBlockSize;
+    block_.push_back(block);
+    block_used_ = 0;
+}
+
+const char* StringPool::Copy( const char* data , std::size_t size ) {
+    if( block_.empty() )
+        NewBlock();
+
+    if( size > kBlockSize / 4 ) {
+        // Large string gets its own block , inserted before the current
+        // block so the space left in the current block is not wasted
+        Block block;
+        block.data = new char[size];
+        block.size = size;
+        block_.insert( block_.end() - 1 , block );
+        std::memcpy(block.data,data,size);
+        return block.data;
+    }
+
+    if( block_used_ + size > block_.back().size )
+        NewBlock();
+
+    char* ret = block_.back().data + block_used_;
+    std::memcpy(ret,data,size);
+    block_used_ += size;
+    return ret;
+}
+
+void StringPool::Rehash() {
+    std::vector<Slot> table( table_.size() * 2 );
+    const std::size_t mask = table.size() - 1;
+
+    for( std::size_t i = 0 ; i < table_.size() ; ++i ) {
+        const Slot& slot = table_[i];
+        if( slot.data == NULL )
+            continue;
+        std::size_t pos = slot.hash & mask;
+        while( table[pos].data != NULL )
+            pos = (pos + 1) & mask;
+        table[pos] = slot;
+    }
+    table_.swap(table);
+}
+
+StringPiece StringPool::Intern( const char* data , std::size_t size ) {
+    const unsigned int hash = Hash(data,size);
+    std::size_t mask = table_.size() - 1;
+    std::size_t pos = hash & mask;
+
+    // Linear probing
+    for( ; table_[pos].data != NULL ; pos = (pos + 1) & mask ) {
+        const Slot& slot = table_[pos];
+        if( slot.hash == hash && slot.size == size &&
+            std::memcmp(slot.data,data,size) == 0 ) {
+            return StringPiece(slot.data,slot.size);
+        }
+    }
+
+    // Empty string still needs a non NULL pointer to mark the slot used
+    static const char kEmpty = 0;
+
+    Slot& slot = table_[pos];
+    slot.data = size == 0 ? &kEmpty : Copy(data,size);
+    slot.size = size;
+    slot.hash = hash;
+
+    StringPiece ret(slot.data,slot.size);
+    if( ++count_ * 2 > table_.size() )
+        Rehash();
+    return ret;
+}
+
+void StringPool::Clear() {
+    // Keep the last block , which is always a normal sized one
+    if( !block_.empty() ) {
+        for( std::size_t i = 0 ; i + 1 < block_.size() ; ++i )
+            delete [] block_[i].data;
+        block_.erase( block_.begin() , block_.end() - 1 );
+    }
+    block_used_ = 0;
+
+    table_.assign( table_.size() , Slot() );
+    count_ = 0;
+}
+
+using tsub::Number;
+
+// Unsigned counterpart of Number , its arithmetic wraps around
+typedef uint64_t UNumber;
+
+const Number kMaxNumber = std::numeric_limits<Number>::max();
+const Number kMinNumber = std::numeric_limits<Number>::min();
+
+// Checked arithmetic of the numbers , each function returns false instead
+// of the result when it overflows. The compiler builtins turn into a single
+// instruction and a branch on the overflow flag.
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_mul_overflow)
+#define TSUB_OVERFLOW_BUILTIN
+#endif
+#endif
+#if !defined(TSUB_OVERFLOW_BUILTIN) && defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 5
+#define TSUB_OVERFLOW_BUILTIN
+#endif
+
+#ifdef TSUB_OVERFLOW_BUILTIN
+inline bool CheckedAdd( Number l , Number r , Number* output ) {
+    return !__builtin_add_overflow(l,r,output);
+}
+
+inline bool CheckedSub( Number l , Number r , Number* output ) {
+    return !__builtin_sub_overflow(l,r,output);
+}
+
+inline bool CheckedMul( Number l , Number r , Number* output ) {
+    return !__builtin_mul_overflow(l,r,output);
+}
+#else
+inline bool CheckedAdd( Number l , Number r , Number* output ) {
+    if( r > 0 ? l > kMaxNumber - r : l < kMinNumber - r )
+        return false;
+    *output = l + r;
+    return true;
+}
+
+inline bool CheckedSub( Number l , Number r , Number* output ) {
+    if( r < 0 ? l > kMaxNumber + r : l < kMinNumber + r )
+        return false;
+    *output = l - r;
+    return true;
+}
+
+inline bool CheckedMul( Number l , Number r , Number* output ) {
+    if( l != 0 && r != 0 ) {
+        if( l > 0 ? ( r > 0 ? l > kMaxNumber / r : r < kMinNumber / l ) :
+                    ( r > 0 ? l < kMinNumber / r : l < kMaxNumber / r ) )
+            return false;
+    }
+    *output = l * r;
+    return true;
+}
+#endif // TSUB_OVERFLOW_BUILTIN
+
+// Division overflows only for the smallest number divided by -1 , the
+// divisor must not be 0
+inline bool CheckedDiv( Number l , Number r , Number* output ) {
+    assert( r != 0 );
+    if( l == kMinNumber && r == -1 )
+        return false;
+    *output = l / r;
+    return true;
+}
+
+inline bool CheckedNeg( Number val , Number* output ) {
+    if( val == kMinNumber )
+        return false;
+    *output = -val;
+    return true;
+}
+
+// Number of elements of the range [fr,en) , it is computed in the unsigned
+// arithmetic so it is exact even if en - fr overflows. Returns false if the
+// count does not fit into std::size_t.
+inline bool RangeCount( Number fr , Number en , std::size_t* count ) {
+    assert( fr < en );
+    UNumber size = static_cast<UNumber>(en) - static_cast<UNumber>(fr);
+    if( size > static_cast<std::size_t>(-1) )
+        return false;
+    *count = static_cast<std::size_t>(size);
+    return true;
+}
+
+// Render the number in decimal two digits at a time. The text is written
+// backward from end , which must have kMaxNumberLength bytes before it ,
+// and the start of the text is returned.
+const std::size_t kMaxNumberLength = 24;
+
+char* FormatNumber( Number num , char* end ) {
+    static const char kDigitPair[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    UNumber val = num < 0 ? 0U - static_cast<UNumber>(num) :
+                            static_cast<UNumber>(num);
+    char* p = end;
+
+    while( val >= 100 ) {
+        const char* pair = kDigitPair + (val % 100) * 2;
+        val /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+
+    if( val < 10 ) {
+        *--p = static_cast<char>('0' + val);
+    } else {
+        *--p = kDigitPair[val*2+1];
+        *--p = kDigitPair[val*2];
+    }
+
+    if( num < 0 )
+        *--p = '-';
+    return p;
+}
+
+void AppendNumber( Number num , std::string* output ) {
+    char buf[kMaxNumberLength];
+    char* end = buf + sizeof(buf);
+    char* begin = FormatNumber(num,end);
+    output->append(begin,end);
+}
+
+// Decimal counter for contiguous range of non negative numbers , each step
+// only touches the digits that change instead of rendering the whole number
+class DecimalCounter {
+public:
+    explicit DecimalCounter( Number start ) {
+        assert( start >= 0 );
+        end_ = buffer_ + sizeof(buffer_);
+        begin_ = FormatNumber(start,end_);
+    }
+
+    StringPiece Get() const {
+        return StringPiece(begin_,end_-begin_);
+    }
+
+    void Increment() {
+        char* p = end_ - 1;
+        while( p >= begin_ && *p == '9' ) {
+            *p = '0';
+            --p;
+        }
+        if( p < begin_ ) {
+            *--begin_ = '1';
+        } else {
+            ++(*p);
+        }
+    }
+
+private:
+    char buffer_[kMaxNumberLength];
+    char* begin_;
+    char* end_;
+};
+
+// String list of each segment , literal segment has only one element. A
+// large range of numbers is kept as an arithmetic progression and each
+// number is rendered only when it is needed , so the memory of such list
+// does not depend on the size of the range.
+class StrList {
+public:
+    StrList():
+        str_(),
+        range_(false),
+        start_(0),
+        step_(0),
+        count_(0)
+        {}
+
+    std::size_t size() const {
+        return range_ ? count_ : str_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    bool IsRange() const {
+        return range_;
+    }
+
+    void push_back( const StringPiece& str ) {
+        assert( !range_ );
+        str_.push_back(str);
+    }
+
+    void reserve( std::size_t size ) {
+        str_.reserve(size);
+    }
+
+    void clear() {
+        str_.clear();
+        range_ = false;
+    }
+
+    // Turn the list into the progression start , start+step , ...
+    void SetRange( Number start , Number step , std::size_t count ) {
+        str_.clear();
+        range_ = true;
+        start_ = start;
+        step_ = step;
+        count_ = count;
+    }
+
+    // The index-th string , the number of a range is rendered into buffer
+    // which must have kMaxNumberLength characters
+    StringPiece Get( std::size_t index , char* buffer ) const {
+        if( !range_ )
+            return str_[index];
+
+        // Wrap around like ValueList::RangeAt
+        Number num = static_cast<Number>( static_cast<UNumber>(start_) +
+            static_cast<UNumber>(index) * static_cast<UNumber>(step_) );
+        char* end = buffer + kMaxNumberLength;
+        char* begin = FormatNumber(num,end);
+        return StringPiece(begin,end-begin);
+    }
+
+    // Total length of all the strings
+    std::size_t Length() const {
+        char buffer[kMaxNumberLength];
+        std::size_t len = 0;
+        for( std::size_t i = 0 ; i < size() ; ++i )
+            len += Get(i,buffer).size;
+        return len;
+    }
+
+private:
+    std::vector< StringPiece > str_;
+    bool range_;
+    Number start_;
+    Number step_;
+    std::size_t count_;
+};
+
+// Size of the cartesian product of the string lists , returns false if it
+// overflows
+bool ProductSize( const std::vector<StrList>& list , std::size_t* size ) {
+    *size = 0;
+    if( list.empty() )
+        return true;
+
+    for( std::size_t i = 0 ; i < list.size() ; ++i ) {
+        if( list[i].empty() )
+            return true;
+    }
+
+    std::size_t result = 1;
+    for( std::size_t i = 0 ; i < list.size() ; ++i ) {
+        std::size_t n = list[i].size();
+        if( result > static_cast<std::size_t>(-1) / n )
+            return false;
+        result *= n;
+    }
+    *size = result;
+    return true;
+}
+
+// Walks the cartesian product of the string lists like an odometer , the
+// first list changes fastest. The product is empty if any list is empty.
+// The walk could start at any position of the product , the position is
+// decoded in mixed radix where the size of each list is the radix.
+class Odometer {
+public:
+    explicit Odometer( const std::vector<StrList>& list , std::size_t start = 0 ):
+        list_(&list),
+        index_(list.size(),0),
+        piece_(list.size()),
+        buffer_(list.size()),
+        done_(list.empty()) {
+            for( std::size_t i = 0 ; i < list.size() ; ++i ) {
+                if( list[i].empty() ) {
+                    done_ = true;
+                    return;
+                }
+                index_[i] = start % list[i].size();
+                start /= list[i].size();
+                Load(i);
+            }
+            // Start is beyond the end of the product
+            if( start != 0 )
+                done_ = true;
+        }
+
+    bool done() const {
+        return done_;
+    }
+
+    // Length of the current string
+    std::size_t Length() const {
+        std::size_t len = 0;
+        for( std::size_t i = 0 ; i < piece_.size() ; ++i )
+            len += piece_[i].size;
+        return len;
+    }
+
+    // Append the current string to the output
+    void Append( std::string* output ) const {
+        for( std::size_t i = 0 ; i < piece_.size() ; ++i )
+            output->append(piece_[i].data,piece_[i].size);
+    }
+
+    // Copy the current string to the output buffer , which must be large
+    // enough , returns the end of the copied string
+    char* Copy( char* output ) const {
+        for( std::size_t i = 0 ; i < piece_.size() ; ++i ) {
+            std::memcpy(output,piece_[i].data,piece_[i].size);
+            output += piece_[i].size;
+        }
+        return output;
+    }
+
+    void Next() {
+        std::size_t i;
+        for( i = 0 ; i < index_.size() ; ++i ) {
+            if( ++index_[i] < (*list_)[i].size() ) {
+                Load(i);
+                return;
+            }
+            index_[i] = 0;
+            Load(i);
+        }
+        done_ = true;
+    }
+
+private:
+    struct NumberBuffer {
+        char data[kMaxNumberLength];
+    };
+
+    void Load( std::size_t i ) {
+        piece_[i] = (*list_)[i].Get(index_[i],buffer_[i].data);
+    }
+
+    const std::vector<StrList>* list_;
+    std::vector<std::size_t> index_;
+
+    // Current string of each list , a rendered number lives in the buffer
+    std::vector<StringPiece> piece_;
+    std::vector<NumberBuffer> buffer_;
+    bool done_;
+
+    Odometer( const Odometer& );
+    Odometer& operator = ( const Odometer& );
+};
+
+#if TSUB_HAS_THREADS
+// Split [0,size) into workers contiguous chunks and call fn(worker,begin,end)
+// for each chunk on its own thread , the first chunk runs on the calling
+// thread. It returns after all the chunks are done.
+template< typename T >
+void ParallelFor( unsigned int workers , std::size_t size , const T& fn ) {
+    std::size_t chunk = size / workers;
+    std::size_t rest  = size % workers;
+    std::vector<std::thread> thread;
+    thread.reserve(workers-1);
+
+    std::size_t begin = chunk + (rest > 0 ? 1 : 0);
+    for( unsigned int i = 1 ; i < workers ; ++i ) {
+        std::size_t end = begin + chunk + (i < rest ? 1 : 0);
+        thread.push_back( std::thread(fn,i,begin,end) );
+        begin = end;
+    }
+
+    fn(0u,static_cast<std::size_t>(0),chunk + (rest > 0 ? 1 : 0));
+
+    for( std::size_t i = 0 ; i < thread.size() ; ++i )
+        thread[i].join();
+}
+#endif // TSUB_HAS_THREADS
+
+#ifndef NDEBUG
+void TestStringPool() {
+    StringPool pool;
+
+    for( int round = 0 ; round < 2 ; ++round ) {
+        std::vector<StringPiece> piece;
+        char buf[32];
+
+        for( int i = 0 ; i < 10000 ; ++i ) {
+            int len = sprintf(buf,"%d",i);
+            piece.push_back( pool.Intern(buf,len) );
+        }
+
+        // Same string gives the same piece
+        for( int i = 0 ; i < 10000 ; ++i ) {
+            int len = sprintf(buf,"%d",i);
+            StringPiece p = pool.Intern(buf,len);
+            assert( p.data == piece[i].data && p.size == piece[i].size );
+            assert( std::string(p.data,p.size) == buf );
+        }
+
+        std::string large( 100000 , 'x' );
+        StringPiece p = pool.Intern(large);
+        assert( pool.Intern(large).data == p.data );
+        assert( pool.Intern("",0).size == 0 );
+        assert( std::string(piece[42].data,piece[42].size) == "42" );
 
-const char* StringAsArray( const std::string& str , int pos ) {
-    return &(*(str.begin() + pos));
+        pool.Clear();
+    }
+
+    // Number rendering
+    static const Number kNumber[] = { 0, 7, 10, 99, 100, 12345, -1, -100, INT_MAX, INT_MIN ,
+        static_cast<Number>(INT_MAX) * 1000 , kMaxNumber , kMinNumber , kMinNumber + 1 };
+    for( std::size_t i = 0 ; i < sizeof(kNumber)/sizeof(Number) ; ++i ) {
+        char buf[kMaxNumberLength];
+        char* end = buf + sizeof(buf);
+        char* p = FormatNumber(kNumber[i],end);
+
+        std::ostringstream ref;
+        ref<<kNumber[i];
+        assert( std::string(p,end) == ref.str() );
+    }
+
+    // Checked arithmetic
+    Number num;
+    assert( CheckedAdd(kMaxNumber-1,1,&num) && num == kMaxNumber );
+    assert( !CheckedAdd(kMaxNumber,1,&num) );
+    assert( !CheckedAdd(kMinNumber,-1,&num) );
+    assert( CheckedSub(-1,kMaxNumber,&num) && num == kMinNumber );
+    assert( !CheckedSub(-2,kMaxNumber,&num) );
+    assert( !CheckedSub(0,kMinNumber,&num) );
+    assert( CheckedMul(3037000499LL,3037000499LL,&num) && num == 9223372030926249001LL );
+    assert( !CheckedMul(3037000500LL,3037000500LL,&num) );
+    assert( !CheckedMul(kMinNumber,-1,&num) );
+    assert( CheckedMul(kMinNumber/2,2,&num) && num == kMinNumber );
+    assert( !CheckedMul(-(kMinNumber/2),2,&num) );
+    assert( !CheckedDiv(kMinNumber,-1,&num) );
+    assert( CheckedDiv(kMinNumber,1,&num) && num == kMinNumber );
+    assert( !CheckedNeg(kMinNumber,&num) );
+    assert( CheckedNeg(kMaxNumber,&num) && num == kMinNumber + 1 );
+
+    DecimalCounter counter(95);
+    for( int i = 95 ; i < 100005 ; ++i ) {
+        char ref[kMaxNumberLength];
+        StringPiece p = counter.Get();
+
+        sprintf(ref,"%d",i);
+        assert( std::string(p.data,p.size) == ref );
+        counter.Increment();
+    }
 }
+#endif // NDEBUG
 
 namespace exp {
 
@@ -97,10 +774,9 @@ static bool IsIdRestChar( int ch ) {
 
 class Scanner {
 public:
-    Scanner( const std::string& source , int pos ) :
+    Scanner( const StringPiece& source , int pos ) :
         position_(pos),
-        start_position_(pos),
-        source_(&source) {
+        source_(source) {
             Next();
         }
 
@@ -132,34 +808,37 @@ public:
         return Next();
     }
 
-    void GetLocation( int* line , int* pos );
 private:
     void SkipSpace() const;
 
     int NChar( int pos ) const {
-        return static_cast<std::size_t>(pos) < source_->size() ? source_->at(pos) : 0 ;
+        return static_cast<std::size_t>(pos) < source_.size ?
+            static_cast<unsigned char>(source_.data[pos]) : 0 ;
     }
 
 private:
     Lexme lexme_;
     mutable int position_;
-    int start_position_;
-    const std::string* source_;
+    StringPiece source_;
 };
 
 void Scanner::SkipSpace() const {
-    while( position_ < static_cast<int>(source_->size()) ) {
-        if ( !std::isspace(source_->at(position_)) )
-            break;
-        position_++;
-    }
+    const char* p = source_.data + position_;
+    const char* end = source_.data + source_.size;
+
+    while( p != end && std::isspace(static_cast<unsigned char>(*p)) )
+        ++p;
+    position_ = static_cast<int>( p - source_.data );
 }
 
 
-void Scanner::GetLocation( int* line , int* pos )  {
+// Convert the source position into line and column number that is relative
+// to the start of the expression.
+void GetSourceLocation( const StringPiece& source , int start , int position ,
+                        int* line , int* pos ) {
     *line = *pos = 1;
-    for( int i = start_position_ ; i < position_ ; ++i ) {
-        if( source_->at(i) == '\n' ) {
+    for( int i = start ; i < position ; ++i ) {
+        if( source.data[i] == '\n' ) {
             *pos = 1;
             ++(*line);
         } else {
@@ -255,23 +934,93 @@ Lexme Scanner::Peek() const {
     } while(true);
 }
 
-class Interp {
+// Abstract syntax tree of the expression language. Each expression inside
+// of the template is parsed only once when the template is compiled, the
+// expansion just walks the tree and never touches the scanner again.
+
+enum NodeType {
+    NODE_NUMBER,NODE_STRING,NODE_DOLLAR,
+    NODE_VARIABLE,NODE_CALL,NODE_LIST,NODE_RANGE,
+    NODE_UNARY,NODE_BINARY,NODE_LOGIC,NODE_TENERY,NODE_POST
+};
+
+struct Node {
+    NodeType type;
+    // Operator token for unary , binary and logic node
+    TokenId op;
+    // Source position that is used to report the evaluation error
+    int position;
+    // Literal value for number and string node
+    Value value;
+    // Variable or function name
+    std::string name;
+    // Operands , list elements or function parameters
+    std::vector<const Node*> child;
+
+    Node( NodeType t , int pos ):
+        type(t),
+        op(TK_UNKNOWN),
+        position(pos)
+        {}
+};
+
+// All the nodes of a template are owned by a single pool, so we don't need
+// to worry about partial tree on the error path of the parser.
+class NodePool {
+public:
+    NodePool() {}
+
+    ~NodePool() {
+        for( std::size_t i = 0 ; i < nodes_.size() ; ++i )
+            delete nodes_[i];
+    }
+
+    Node* New( NodeType type , int pos ) {
+        nodes_.push_back( new Node(type,pos) );
+        return nodes_.back();
+    }
+
+    std::size_t size() const {
+        return nodes_.size();
+    }
+
+private:
+    std::vector<Node*> nodes_;
+
+    NodePool( const NodePool& );
+    NodePool& operator = ( const NodePool& );
+};
+
+void FormatError( const StringPiece& source , int start , int position ,
+                  const char* msg , std::string* error ) {
+    int line, pos;
+    std::stringstream formatter;
+
+    GetSourceLocation(source,start,position,&line,&pos);
+    formatter<<"[Module:Interp,Location:("<<
+        line<<","<<pos<<")]:\n"<<msg<<"\n";
+    *error = formatter.str();
+}
+
+class Parser {
 public:
-    Interp( const std::string& source,
+    Parser( const StringPiece& source,
             int pos,
-            Context* context,
+            NodePool* pool,
             std::string* error ):
 
-        source_(&source),
+        source_(source),
         scanner_(source,pos),
-        context_(context),
-        dollar_value_(NULL),
+        start_position_(pos),
+        pool_(pool),
         error_(error){}
 
-    bool DoInterp( Value* val , int* cur_pos ) {
-        if(!InterpExp(val))
+    bool DoParse( const Node** node , int* cur_pos ) {
+        Node* n;
+        if(!ParseExp(&n))
             return false;
         else {
+            *node = n;
             *cur_pos = scanner_.position();
             return true;
         }
@@ -293,164 +1042,151 @@ private:
         }
     }
 
-
-    bool InterpListRange( Value* to );
-    bool InterpList  ( Value* output );
-    bool InterpFunc  ( const std::string& func_name , Value* output );
-    bool InterpPF    ( Value* output );
-    bool InterpAtomic( Value* output );
-    bool InterpUnary ( Value* output );
-    bool InterpFactor( Value* output );
-    bool InterpTerm  ( Value* output );
-    bool InterpComp  ( Value* output );
-    bool InterpLogic ( Value* output );
-    bool InterpPostExp( Value* output );
-    bool InterpTenery( Value* output );
-    bool InterpExp   ( Value* output );
-
-    bool ToBool( const Value& cond );
+    bool ParseList  ( Node** output );
+    bool ParseFunc  ( const StringPiece& func_name , Node** output );
+    bool ParsePF    ( Node** output );
+    bool ParseAtomic( Node** output );
+    bool ParseUnary ( Node** output );
+    bool ParseFactor( Node** output );
+    bool ParseTerm  ( Node** output );
+    bool ParseComp  ( Node** output );
+    bool ParseLogic ( Node** output );
+    bool ParsePostExp( Node** output );
+    bool ParseTenery( Node** output );
+    bool ParseExp   ( Node** output );
+
+    Node* NewBinary( NodeType type , TokenId op , const Node* lhs , const Node* rhs ) {
+        Node* node = pool_->New(type,scanner_.position());
+        node->op = op;
+        node->child.push_back(lhs);
+        node->child.push_back(rhs);
+        return node;
+    }
 
 private:
 
     bool ParseNumber( Value* output );
     bool ParseString( Value* output );
-    bool ParseVariable( std::string* var );
-
+    bool ParseVariable( StringPiece* var );
 
 private:
-    const std::string* source_;
+    const StringPiece source_;
     Scanner scanner_;
-    Context* context_;
-    const Value* dollar_value_;
+    int start_position_;
+    NodePool* pool_;
     std::string* error_;
 };
 
-bool Interp::ToBool( const Value& cond ) {
-    switch(cond.type()) {
-        case Value::VALUE_STRING:
-        case Value::VALUE_LIST:
-            return true;
-        case Value::VALUE_NUMBER:
-            return cond.GetNumber() != 0;
-        case Value::VALUE_NULL:
-            return false;
-        default:
-            UNREACHABLE(return false);
-    }
-}
-
-void Interp::ReportError( const char* format , ... )  {
+void Parser::ReportError( const char* format , ... )  {
     char msg[1024];
     va_list vlist;
-    std::stringstream formatter;
-    int line, pos;
 
     va_start(vlist,format);
     vsprintf(msg,format,vlist);
+    va_end(vlist);
 
-    scanner_.GetLocation(&line,&pos);
-    formatter<<"[Module:Interp,Location:("<<
-        line<<","<<pos<<")]:\n"<<msg<<"\n";
-    *error_ = formatter.str();
+    FormatError(source_,start_position_,scanner_.position(),msg,error_);
 }
 
-
-
-bool Interp::ParseNumber( Value* output ) {
+bool Parser::ParseNumber( Value* output ) {
     assert( scanner_.lexme().token == TK_NUMBER );
-    // Parsing the number from the current stream, we just use strtol
-    errno = 0;
-    char* pend;
-
-    long val = std::strtol(
-        StringAsArray( *source_ , scanner_.position() ),
-        &pend , 10 );
-
-    if( errno ) {
-        return false;
-    } else {
-        scanner_.Move( pend - StringAsArray(*source_, scanner_.position() ) );
-        output->SetNumber( static_cast<int>(val) );
-        return true;
+    // The source is not NUL terminated , so the digits are accumulated here
+    // instead of strtoll , with the same range check
+    const char* begin = source_.data + scanner_.position();
+    const char* end = source_.data + source_.size;
+    const char* p;
+    Number val = 0;
+
+    for( p = begin ; p != end && *p >= '0' && *p <= '9' ; ++p ) {
+        Number digit = *p - '0';
+        if( val > (kMaxNumber - digit) / 10 ) {
+            ReportError("Number literal is out of range");
+            return false;
+        }
+        val = val * 10 + digit;
     }
 
+    scanner_.Move( p - begin );
+    output->SetNumber(val);
+    return true;
 }
 
-bool Interp::ParseVariable( std::string* variable ) {
+bool Parser::ParseVariable( StringPiece* variable ) {
     assert( scanner_.lexme().token == TK_VARIABLE );
-    int i;
+    // The name is a view into the source
+    const char* begin = source_.data + scanner_.position();
+    const char* end = source_.data + source_.size;
+    const char* p;
 
-    for( i = static_cast<int>(scanner_.position())+1 ;
-             i < static_cast<int>(source_->size()) && IsIdRestChar( source_->at(i) ) ;
-             ++i ) ;
+    for( p = begin + 1 ; p != end && IsIdRestChar( static_cast<unsigned char>(*p) ) ; ++p ) ;
 
-    variable->assign(
-        StringAsArray(*source_,scanner_.position() ),
-        i-scanner_.position() );
-    scanner_.Set( i );
+    *variable = StringPiece( begin , p - begin );
+    scanner_.Set( static_cast<int>( p - source_.data ) );
     return true;
 }
 
-bool Interp::ParseString( Value* output ) {
+bool Parser::ParseString( Value* output ) {
     assert( scanner_.lexme().token == TK_STRING );
-    assert( source_->at( scanner_.position() ) == '\"' );
+    assert( source_.data[ scanner_.position() ] == '\"' );
 
-    int i;
+    // The text between two escape characters is copied as a whole , a
+    // literal without escape is copied straight from the source
+    const char* end = source_.data + source_.size;
+    const char* run = source_.data + scanner_.position() + 1;
+    const char* p;
     std::string buffer;
-
-    for( i = static_cast<int>(scanner_.position()) + 1 ;
-         i < static_cast<int>(source_->size()) ; ++i ) {
-        if( source_->at(i) == '\\' ) {
-            // Checking if we are meeting some sort of escape character here
-            if( i+1 < static_cast<int>(source_->size()) ) {
-                if( IsEscapeChar( source_->at(i+1) ) ) {
-                    ++i;
-                    buffer.push_back( source_->at(i) );
-                    continue;
-                }
-            }
+    bool escaped = false;
+
+    for( p = run ; p != end ; ++p ) {
+        if( *p == '\\' && p+1 != end && IsEscapeChar(p[1]) ) {
+            // The escaped character starts the next run
+            buffer.append(run,p);
+            run = ++p;
+            escaped = true;
+            continue;
         }
 
-        if( source_->at(i) == '\"' )
+        if( *p == '\"' )
             break;
-        buffer.push_back( source_->at(i) );
-
     }
 
-    if( i == static_cast<int>(source_->size()) ) {
+    if( p == end ) {
+        ReportError("String literal is not closed by \"");
         return false;
-    } else {
-        assert( source_->at(i) == '\"' );
-        scanner_.Set(i+1);
+    }
+
+    if( escaped ) {
+        buffer.append(run,p);
         output->SetString(buffer);
-        return true;
+    } else {
+        output->SetString(run,p-run);
     }
+    scanner_.Set( static_cast<int>( p - source_.data ) + 1 );
+    return true;
 }
 
-bool Interp::InterpAtomic( Value* output ) {
+bool Parser::ParseAtomic( Node** output ) {
     switch( scanner_.lexme().token ) {
         case TK_LSQR:
             // [ means a list literal is appeared, just parse it as a atomic value
-            return InterpList( output );
+            return ParseList( output );
         case TK_DOLLAR:
-            if( dollar_value_ == NULL ) {
-                ReportError("Dollar value is not set!");
-                return false;
-            } else {
-                *output = *dollar_value_;
-                scanner_.Move();
-                return true;
-            }
+            // The dollar value is only known at evaluation time, report
+            // the error at the place where the dollar appears
+            *output = pool_->New(NODE_DOLLAR,scanner_.position());
+            scanner_.Move();
+            return true;
         case TK_VARIABLE:
-            return InterpPF(output);
+            return ParsePF(output);
         case TK_NUMBER:
-            return ParseNumber(output);
+            *output = pool_->New(NODE_NUMBER,scanner_.position());
+            return ParseNumber(&((*output)->value));
         case TK_STRING:
-            return ParseString(output);
+            *output = pool_->New(NODE_STRING,scanner_.position());
+            return ParseString(&((*output)->value));
         case TK_LPAR:
             scanner_.Move();
-            if(!InterpExp(output))
-
+            if(!ParseExp(output))
                 return false;
             if( scanner_.lexme().token != TK_RPAR ) {
                 ReportError("Expect ')'");
@@ -465,19 +1201,9 @@ bool Interp::InterpAtomic( Value* output ) {
     }
 }
 
-bool Interp::InterpListRange( Value* output ) {
-    if( scanner_.lexme().token != TK_TO )
-        return false;
-    else {
-        scanner_.Move();
-        return InterpExp(output);
-    }
-}
-
-bool Interp::InterpList( Value* output ) {
+bool Parser::ParseList( Node** output ) {
     // List literal has grammer like this : [ exp , exp , exp..exp ]
-    // Just to make sure that we understand the \"..\" which means to
-    // literal. And we need to expand the to literal once we meet it
+    // The range is kept as a node and expanded at evaluation time
     assert( scanner_.lexme().token == TK_LSQR );
     scanner_.Move();
 
@@ -491,48 +1217,26 @@ bool Interp::InterpList( Value* output ) {
         return false;
     }
 
-    // We don't have unique_ptr in C++03, just use raw pointer but make
-    // sure we delete it in any exit statements
-    ValueList* vl = new ValueList();
+    Node* list = pool_->New(NODE_LIST,scanner_.position());
 
     do {
-        Value val;
-        Value to; // Optional we have a to
+        Node* val;
 
         // Parsing it as an expression here
-        if( !Interp::InterpExp(&val) ) {
-            delete vl;
+        if( !ParseExp(&val) )
             return false;
-        }
 
         // Checking if we meet range statements here
-        if( InterpListRange(&to) ) {
-            // We got a to, just expand this range to actual list
-            if( to.type() != Value::VALUE_NUMBER ||
-                val.type()!= Value::VALUE_NUMBER ) {
-                delete vl;
-                // For simplicity , we currently only allows the type number
-                // to have to operator .
-                ReportError("\"..\" operator can have operand number");
+        if( scanner_.lexme().token == TK_TO ) {
+            Node* to;
+            scanner_.Move();
+            if( !ParseExp(&to) )
                 return false;
-            } else {
-                // Now expanding the fr and to range
-                int fr = val.GetNumber();
-                int en = to.GetNumber();
-                if( fr >= en ) {
-                    delete vl;
-                    ReportError("\"..\" operator must have a strictly less than relation for its left and right operands");
-                    return false;
-                }
-                // Expanding the range to the value list elements
-                for( ; fr < en ; ++fr ) {
-                    vl->AddValue(fr);
-                }
-            }
-        } else {
-            vl->AddValue(val);
+            val = NewBinary(NODE_RANGE,TK_TO,val,to);
         }
 
+        list->child.push_back(val);
+
         // Now we check that we can meet the , or ] here
         if( scanner_.lexme().token == TK_COMMA ) {
             scanner_.Move();
@@ -541,26 +1245,25 @@ bool Interp::InterpList( Value* output ) {
             scanner_.Move();
             break;
         } else {
-            delete vl;
             ReportError("list literal has unexpected token:%s",GetTokenName( scanner_.lexme().token ) );
             return false;
         }
 
     } while(true);
 
-    output->SetList( vl );
+    *output = list;
     return true;
 }
 
-bool Interp::InterpFunc( const std::string& func_name , Value* output ) {
+bool Parser::ParseFunc( const StringPiece& func_name , Node** output ) {
     assert( scanner_.lexme().token == TK_LPAR );
     scanner_.Move();
 
-    std::vector<Value> par ;
+    std::vector<const Node*> par ;
 
     do {
-        Value val;
-        if( !InterpExp(&val) )
+        Node* val;
+        if( !ParseExp(&val) )
             return false;
         par.push_back(val);
         // Checking the comma or the RPAR
@@ -577,112 +1280,65 @@ bool Interp::InterpFunc( const std::string& func_name , Value* output ) {
         }
     } while(true);
 
-    if( context_ == NULL ) {
-        ReportError("Function:%s doesn't have context to be executed",
-            func_name.c_str());
-        return false;
-    } else {
-        std::string error;
-        if( !context_->ExecFunction(func_name,par,output,&error) ) {
-            ReportError("Function:%s cannot be executed with error:%s",
-                func_name.c_str(),
-                error.c_str());
-            return false;
-        } else {
-            return true;
-        }
-    }
+    Node* node = pool_->New(NODE_CALL,scanner_.position());
+    node->name.assign(func_name.data,func_name.size);
+    node->child.swap(par);
+    *output = node;
+    return true;
 }
 
-
-bool Interp::InterpPF( Value* output ) {
+bool Parser::ParsePF( Node** output ) {
     // Variable prefix expression, could be variable reference or function call
     assert( scanner_.lexme().token == TK_VARIABLE );
-    std::string var;
+    StringPiece var;
     if( !ParseVariable(&var) ) {
         return false;
     }
 
     if( scanner_.lexme().token == TK_LPAR ) {
         // A function call goes here
-        return InterpFunc(var,output);
+        return ParseFunc(var,output);
     } else {
-        if( context_ == NULL ) {
-            ReportError("Variable:%s doesn't have context to look up",var.c_str());
-            return false;
-        } else {
-            if( !context_->GetVariable(var,output) ) {
-                ReportError("Variable:%s is not existed",var.c_str());
-                return false;
-            }
-            return true;
-        }
+        Node* node = pool_->New(NODE_VARIABLE,scanner_.position());
+        node->name.assign(var.data,var.size);
+        *output = node;
+        return true;
     }
 }
 
-bool Interp::InterpUnary( Value* output ) {
-    switch( scanner_.lexme().token ) {
-        case TK_ADD:
-            scanner_.Move();
-            if(!InterpAtomic(output))
-                return false;
-            if( output->type() != Value::VALUE_NUMBER ) {
-                ReportError("Cannot prefix +/- for string");
-                return false;
-            }
-            return true;
-        case TK_SUB:
-            scanner_.Move();
-            if(!InterpAtomic(output))
-                return false;
-            if( output->type() != Value::VALUE_NUMBER ) {
-                ReportError("Cannot prefix +/- for string");
-                return false;
-            } else {
-                output->SetNumber( -output->GetNumber() );
-                return true;
-            }
-         case TK_NOT:
-            scanner_.Move();
-            if(!InterpAtomic(output))
-                return false;
-            switch( output->type() ) {
-                case Value::VALUE_NUMBER:
-                    output->SetNumber(!output->GetNumber());
-                    return true;
-                case Value::VALUE_STRING:
-                    output->SetNumber(0);
-                    return true;
-                case Value::VALUE_NULL:
-                case Value::VALUE_LIST:
-                    output->SetNumber(1);
+bool Parser::ParseUnary( Node** output ) {
+    TokenId op = scanner_.lexme().token;
+    Node* operand;
 
-                    return true;
-                default:
-                    UNREACHABLE(return false);
-            }
-        default:
-            UNREACHABLE(return false);
-    }
+    assert( op == TK_ADD || op == TK_SUB || op == TK_NOT );
+    scanner_.Move();
+    if(!ParseAtomic(&operand))
+        return false;
+
+    Node* node = pool_->New(NODE_UNARY,scanner_.position());
+    node->op = op;
+    node->child.push_back(operand);
+    *output = node;
+    return true;
 }
 
-bool Interp::InterpFactor( Value* output ) {
+bool Parser::ParseFactor( Node** output ) {
     switch( scanner_.lexme().token ) {
         case TK_ADD:
         case TK_SUB:
         case TK_NOT:
-            return InterpUnary(output);
+            return ParseUnary(output);
         default:
-            return InterpAtomic(output);
+            return ParseAtomic(output);
     }
 }
 
-bool Interp::InterpTerm( Value* output ) {
-    if( !InterpFactor(output) )
+bool Parser::ParseTerm( Node** output ) {
+    if( !ParseFactor(output) )
         return false;
     do {
         TokenId op;
-        Value rhs;
+        Node* rhs;
 
         switch( scanner_.lexme().token ) {
             case TK_MUL:
@@ -695,35 +1351,21 @@ bool Interp::InterpTerm( Value* output ) {
 
         }
 
-        if( !InterpFactor(&rhs) )
-            return false;
-
-        if( output->type() != Value::VALUE_NUMBER ||
-                rhs.type() != Value::VALUE_NUMBER ) {
-            ReportError("* / can only be used with operand number");
+        if( !ParseFactor(&rhs) )
             return false;
-        }
 
-        if( op == TK_MUL ) {
-            output->SetNumber( output->GetNumber() * rhs.GetNumber() );
-        } else {
-            if( rhs.GetNumber() == 0 ) {
-                ReportError("Divide zero!");
-                return false;
-            }
-            output->SetNumber( output->GetNumber() / rhs.GetNumber() );
-        }
+        *output = NewBinary(NODE_BINARY,op,*output,rhs);
     } while(true);
 
 }
 
-bool Interp::InterpComp( Value* output ) {
-    if( !InterpTerm(output) )
+bool Parser::ParseComp( Node** output ) {
+    if( !ParseTerm(output) )
         return false;
 
     do {
         TokenId op;
-        Value rhs;
+        Node* rhs;
 
         switch( scanner_.lexme().token ) {
             case TK_ADD:
@@ -735,45 +1377,21 @@ bool Interp::InterpComp( Value* output ) {
                 return true;
         }
 
-        if( !InterpTerm(&rhs) )
-            return false;
-
-
-        if( output->type() != Value::VALUE_NUMBER ||
-            rhs.type() != Value::VALUE_NUMBER ) {
-            ReportError("+ - can only work with number operand");
+        if( !ParseTerm(&rhs) )
             return false;
-        }
-
-        if( op == TK_ADD ) {
-            output->SetNumber( output->GetNumber() + rhs.GetNumber() );
-        } else {
-            output->SetNumber( output->GetNumber() - rhs.GetNumber() );
-        }
 
+        *output = NewBinary(NODE_BINARY,op,*output,rhs);
     } while(true);
 
 }
 
-#define _DO(tk,T) do {\
-    switch(tk) { \
-        case TK_LT: output->SetNumber( output->Get##T() < rhs.Get##T() ? 1 : 0 ); break; \
-        case TK_LET: output->SetNumber( output->Get##T() <= rhs.Get##T() ? 1 : 0 ); break; \
-        case TK_GT: output->SetNumber( output->Get##T() > rhs.Get##T() ? 1 : 0 ); break; \
-        case TK_GET: output->SetNumber( output->Get##T() >= rhs.Get##T() ? 1 : 0 ); break; \
-        case TK_EQ: output->SetNumber( output->Get##T() == rhs.Get##T() ? 1 : 0 ) ; break; \
-        case TK_NEQ: output->SetNumber( output->Get##T() != rhs.Get##T() ? 1 : 0 ); break; \
-        default: UNREACHABLE(return false); \
-    } } while(0)
-
-
-bool Interp::InterpLogic( Value* output ) {
-    if( !InterpComp( output ) )
+bool Parser::ParseLogic( Node** output ) {
+    if( !ParseComp( output ) )
         return false;
 
     do {
         TokenId op;
-        Value rhs;
+        Node* rhs;
 
         switch( scanner_.lexme().token ) {
             case TK_LT:
@@ -789,40 +1407,19 @@ bool Interp::InterpLogic( Value* output ) {
                 return true;
         }
 
-        if( !InterpComp(&rhs) )
+        if( !ParseComp(&rhs) )
             return false;
 
-        // Do comparison logic for string and number separately.
-        // We don't convert string to number automatically by default.
-
-        if( rhs.type() == Value::VALUE_STRING ) {
-            if( output->type() != Value::VALUE_STRING ) {
-                ReportError("String can only compared to string");
-                return false;
-            }
-            _DO(op,String);
-        } else if( rhs.type() == Value::VALUE_NUMBER ) {
-            if( output->type() != Value::VALUE_NUMBER ) {
-                ReportError("Number can only compared to number");
-                return false;
-            }
-
-            _DO(op,Number);
-        } else {
-            ReportError("Only string/number can do comparison!");
-            return false;
-        }
+        *output = NewBinary(NODE_BINARY,op,*output,rhs);
     } while(true);
 }
 
-#undef _DO
-
-bool Interp::InterpTenery( Value* output ) {
-    if( !InterpLogic(output) )
+bool Parser::ParseTenery( Node** output ) {
+    if( !ParseLogic(output) )
         return false;
     do {
         TokenId op;
-        Value rhs;
+        Node* rhs;
 
         switch( scanner_.lexme().token ) {
             case TK_AND:
@@ -834,59 +1431,24 @@ bool Interp::InterpTenery( Value* output ) {
                 return true;
         }
 
-        if( !InterpLogic(&rhs) )
+        if( !ParseLogic(&rhs) )
             return false;
 
-        assert( output->type() != Value::VALUE_NULL &&
-                rhs.type() != Value::VALUE_NULL );
-
-        if( op == TK_AND ) {
-            if( output->type() == Value::VALUE_NUMBER ) {
-                if( output->GetNumber() == 0 ) {
-
-                output->SetNumber(0);
-                    continue;
-                }
-            }
-
-            if( rhs.type() == Value::VALUE_NUMBER ) {
-                if( rhs.GetNumber() == 0 ) {
-                    output->SetNumber(0);
-                    continue;
-                }
-            }
-
-            output->SetNumber(1);
-
-        } else {
-            if( output->type() == Value::VALUE_NUMBER ) {
-                if( output->GetNumber() != 0 ) {
-                    output->SetNumber(1);
-                    continue;
-                }
-            }
-            if( rhs.type() == Value::VALUE_NUMBER ) {
-                if( rhs.GetNumber() != 0 ) {
-                    output->SetNumber(1);
-                    continue;
-                }
-            }
-            output->SetNumber(0);
-        }
+        *output = NewBinary(NODE_LOGIC,op,*output,rhs);
     } while(true);
 }
 
-bool Interp::InterpPostExp( Value* output ) {
-    if( !InterpTenery(output) )
+bool Parser::ParsePostExp( Node** output ) {
+    if( !ParseTenery(output) )
         return false;
     if( scanner_.lexme().token == TK_QUESTION ) {
         // We meet the \"?\" therefore we can be sure that it is a
         // tenery expression here.
+        Node* l;
+        Node* r;
+
         scanner_.Move();
-        // We have to evaluate the both expression otherwise we need
-        // to skip the other block
-        Value l , r;
-        if( !InterpExp(&l) )
+        if( !ParseExp(&l) )
             return false;
 
         if( scanner_.lexme().token != TK_COLON ) {
@@ -895,467 +1457,4183 @@ bool Interp::InterpPostExp( Value* output ) {
         }
         scanner_.Move();
 
-        if( !InterpExp(&r) )
+        if( !ParseExp(&r) )
             return false;
 
-        if( ToBool(*output) ) {
-            *output = l;
-        } else {
-            *output = r;
-        }
+        Node* node = pool_->New(NODE_TENERY,scanner_.position());
+        node->child.push_back(*output);
+        node->child.push_back(l);
+        node->child.push_back(r);
+        *output = node;
     }
     return true;
 }
 
-bool Interp::InterpExp( Value* output ) {
+bool Parser::ParseExp( Node** output ) {
     // Post expression is as simple as a {} body. It contains
     // a single line expression and it optionally can have a
     // dollar variable. This dollar variable will smartly expand
     // to context value that resides on its left side . Eg:
     // [1,2,3,4] { $*2 } will make the output to [2,4,6,8].
-    if( !InterpPostExp(output) )
+    if( !ParsePostExp(output) )
         return false;
 
     if( scanner_.lexme().token == TK_LBRA ) {
-        ValueList* new_list = new ValueList();
+        Node* body;
 
-        // Post Expression
         scanner_.Move();
+        if( !ParseExp(&body) )
+            return false;
 
-        // Now set up the context value based on the type of the output value
-        if( output->type() == Value::VALUE_LIST ) {
-            // Foreach semantic goes here
-            const ValueList& l = output->GetList();
-            // Remeber the current scanner position, since after each loop
-            // we need to rewind back to where we are now
-            int pos = scanner_.position();
-            int end ;
+        // Checking the end of body
+        if( scanner_.lexme().token != TK_RBRA ) {
+            ReportError("Post expression needs } to close the body");
+            return false;
+        }
+        scanner_.Move();
 
-            // Checking the end of the expression _ONLY_ once
-            bool check_end = true;
+        *output = NewBinary(NODE_POST,TK_LBRA,*output,body);
+    }
+    return true;
+}
 
-            for( std::size_t i = 0 ; i < l.size() ; ++i ) {
-                dollar_value_ = &l.Index(i);
-                Value new_val;
+// Operator semantics shared by the tree walking interpreter and the VM, so
+// both of them always agree on the result. Each function returns the error
+// message or NULL when the operation succeeds.
 
-                if(!InterpExp(&new_val)) {
-                    delete new_list;
-                    return false;
-                }
+const char* const kOverflow = "Integer overflow!";
 
-                if( check_end ) {
-                    // Checking if we meet that } to indicate the end of the
-                    // expression body
-                    if( scanner_.lexme().token != TK_RBRA ) {
-                        delete new_list;
-                        ReportError("Post expression needs } to close the body");
-                        return false;
-                    }
-                    // Move the scanner to set the correct end position
-                    scanner_.Move();
-                    end = scanner_.position();
+bool ToBool( const Value& cond ) {
+    switch(cond.type()) {
+        case Value::VALUE_STRING:
+        case Value::VALUE_LIST:
+            return true;
+        case Value::VALUE_NUMBER:
+            return cond.GetNumber() != 0;
+        case Value::VALUE_NULL:
+            return false;
+        default:
+            UNREACHABLE(return false);
+    }
+}
 
-                    // Run only once
-                    check_end = false;
-                }
+const char* UnaryOp( TokenId op , Value* output ) {
+    switch( op ) {
+        case TK_ADD:
+            if( output->type() != Value::VALUE_NUMBER )
+                return "Cannot prefix +/- for string";
+            return NULL;
+        case TK_SUB: {
+            if( output->type() != Value::VALUE_NUMBER )
+                return "Cannot prefix +/- for string";
+            Number result;
+            if( !CheckedNeg(output->GetNumber(),&result) )
+                return kOverflow;
+            output->SetNumber(result);
+            return NULL;
+        }
+        case TK_NOT:
+            switch( output->type() ) {
+                case Value::VALUE_NUMBER:
+                    output->SetNumber(!output->GetNumber());
+                    return NULL;
+                case Value::VALUE_STRING:
+                    output->SetNumber(0);
+                    return NULL;
+                case Value::VALUE_NULL:
+                case Value::VALUE_LIST:
+                    output->SetNumber(1);
+                    return NULL;
+                default:
+                    UNREACHABLE(return NULL);
+            }
+        default:
+            UNREACHABLE(return NULL);
+    }
+}
+
+const char* ArithOp( TokenId op , Value* output , const Value& rhs ) {
+    Number result;
 
-                // Now we have a new value here
-                new_list->AddValue(new_val);
-                // Rewind back to where we start to interpret the small value
-                scanner_.Set(pos);
+    switch( op ) {
+        case TK_MUL:
+        case TK_DIV:
+            if( output->type() != Value::VALUE_NUMBER ||
+                    rhs.type() != Value::VALUE_NUMBER ) {
+                return "* / can only be used with operand number";
             }
 
-            // Set the scanner to the correct position for new token
-            scanner_.Set(end);
-            // Change the output
-            output->SetList(new_list);
-            // We definitly have already checked the end of the body, so just return
-            return true;
-        } else {
-            Value new_val;
+            if( op == TK_MUL ) {
+                if( !CheckedMul( output->GetNumber() , rhs.GetNumber() , &result ) )
+                    return kOverflow;
+            } else {
+                if( rhs.GetNumber() == 0 ) {
+                    return "Divide zero!";
+                }
+                if( !CheckedDiv( output->GetNumber() , rhs.GetNumber() , &result ) )
+                    return kOverflow;
+            }
+            output->SetNumber(result);
+            return NULL;
 
-            // Scalar value
-            dollar_value_ = output;
-            if( !InterpExp(&new_val) )
-                return false;
-            // Checking the end of body
-            if( scanner_.lexme().token != TK_RBRA ) {
-                ReportError("Post expression needs } to close the body");
-                return false;
+        case TK_ADD:
+        case TK_SUB:
+            if( output->type() != Value::VALUE_NUMBER ||
+                rhs.type() != Value::VALUE_NUMBER ) {
+                return "+ - can only work with number operand";
             }
-            scanner_.Move();
 
-            *output = new_val;
-            return true;
-        }
+            if( op == TK_ADD ? !CheckedAdd( output->GetNumber() , rhs.GetNumber() , &result ) :
+                               !CheckedSub( output->GetNumber() , rhs.GetNumber() , &result ) )
+                return kOverflow;
+            output->SetNumber(result);
+            return NULL;
+
+        default:
+            UNREACHABLE(return NULL);
     }
-    return true;
 }
 
-#ifndef NDEBUG
-void TestScanner() {
-    std::string txt = "(),+-*/ ><>=>===!= ! && ||";
-    Scanner scanner(txt,0);
+#define _DO(tk,T) do {\
+    switch(tk) { \
+        case TK_LT: output->SetNumber( output->Get##T() < rhs.Get##T() ? 1 : 0 ); break; \
+        case TK_LET: output->SetNumber( output->Get##T() <= rhs.Get##T() ? 1 : 0 ); break; \
+        case TK_GT: output->SetNumber( output->Get##T() > rhs.Get##T() ? 1 : 0 ); break; \
+        case TK_GET: output->SetNumber( output->Get##T() >= rhs.Get##T() ? 1 : 0 ); break; \
+        case TK_EQ: output->SetNumber( output->Get##T() == rhs.Get##T() ? 1 : 0 ) ; break; \
+        case TK_NEQ: output->SetNumber( output->Get##T() != rhs.Get##T() ? 1 : 0 ); break; \
+        default: UNREACHABLE(return NULL); \
+    } } while(0)
 
-    do {
-        Lexme tk = scanner.Next();
-        if (tk.token == TK_EOF)
-            break;
-        std::cout<< GetTokenName(tk.token) << std::endl;
-        scanner.Move();
+const char* CompareOp( TokenId op , Value* output , const Value& rhs ) {
+    // Do comparison logic for string and number separately.
+    // We don't convert string to number automatically by default.
 
-    } while(true);
-    std::cout<<"We are done!"<<std::endl;
-}
+    if( rhs.type() == Value::VALUE_STRING ) {
+        if( output->type() != Value::VALUE_STRING ) {
+            return "String can only compared to string";
+        }
+        _DO(op,String);
+    } else if( rhs.type() == Value::VALUE_NUMBER ) {
+        if( output->type() != Value::VALUE_NUMBER ) {
+            return "Number can only compared to number";
+        }
 
-class TestContext : public Context {
+        _DO(op,Number);
+    } else {
+        return "Only string/number can do comparison!";
+    }
+    return NULL;
+}
+
+#undef _DO
+
+// Check whether the result of && or || is decided by its left operand , in
+// that case the output is set to the result and the right operand must not
+// be evaluated at all.
+bool LogicShortCut( TokenId op , Value* output ) {
+    if( output->type() != Value::VALUE_NUMBER )
+        return false;
+
+    if( op == TK_AND ) {
+        if( output->GetNumber() == 0 ) {
+            output->SetNumber(0);
+            return true;
+        }
+    } else {
+        if( output->GetNumber() != 0 ) {
+            output->SetNumber(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void LogicOp( TokenId op , Value* output , const Value& rhs ) {
+    assert( output->type() != Value::VALUE_NULL &&
+            rhs.type() != Value::VALUE_NULL );
+
+    if( op == TK_AND ) {
+        if( output->type() == Value::VALUE_NUMBER ) {
+            if( output->GetNumber() == 0 ) {
+                output->SetNumber(0);
+                return;
+            }
+        }
+
+        if( rhs.type() == Value::VALUE_NUMBER ) {
+            if( rhs.GetNumber() == 0 ) {
+                output->SetNumber(0);
+                return;
+            }
+        }
+
+        output->SetNumber(1);
+
+    } else {
+        if( output->type() == Value::VALUE_NUMBER ) {
+            if( output->GetNumber() != 0 ) {
+                output->SetNumber(1);
+                return;
+            }
+        }
+        if( rhs.type() == Value::VALUE_NUMBER ) {
+            if( rhs.GetNumber() != 0 ) {
+                output->SetNumber(1);
+                return;
+            }
+        }
+        output->SetNumber(0);
+    }
+}
+
+// Constant folding of the syntax tree. An operation whose operands are all
+// literal is replaced by a literal node of its result , and a tenery whose
+// condition is literal is replaced by the branch that is taken. Operations
+// that fail are kept as they are , so the error is still reported when the
+// template is expanded. The folded nodes are owned by the same pool.
+class Folder {
+public:
+    Folder( NodePool* pool ):
+        pool_(pool)
+        {}
+
+    const Node* Fold( const Node* node );
+
+    // Whether the value of the node depends on nothing but literals
+    static bool IsConstant( const Node* node );
+
+    // Upper bound of the number of strings the value of the node renders
+    // to , anything larger than limit is returned as limit+1
+    static std::size_t SizeBound( const Node* node , std::size_t limit );
+
+private:
+    static bool IsLiteral( const Node* node ) {
+        return node->type == NODE_NUMBER || node->type == NODE_STRING;
+    }
+
+    const Node* NewLiteral( const Node* node , const Value& value );
+
+private:
+    NodePool* pool_;
+};
+
+const Node* Folder::NewLiteral( const Node* node , const Value& value ) {
+    Node* literal = pool_->New( value.type() == Value::VALUE_NUMBER ?
+        NODE_NUMBER : NODE_STRING , node->position );
+    literal->value = value;
+    return literal;
+}
+
+const Node* Folder::Fold( const Node* node ) {
+    std::vector<const Node*> child( node->child.size() );
+    bool changed = false;
+
+    for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+        child[i] = Fold(node->child[i]);
+        if( child[i] != node->child[i] )
+            changed = true;
+    }
+
+    switch( node->type ) {
+        case NODE_UNARY:
+            if( IsLiteral(child[0]) ) {
+                Value val( child[0]->value );
+                if( UnaryOp(node->op,&val) == NULL )
+                    return NewLiteral(node,val);
+            }
+            break;
+        case NODE_BINARY:
+            if( IsLiteral(child[0]) && IsLiteral(child[1]) ) {
+                Value val( child[0]->value );
+                const char* error;
+                switch( node->op ) {
+                    case TK_ADD:
+                    case TK_SUB:
+                    case TK_MUL:
+                    case TK_DIV:
+                        error = ArithOp(node->op,&val,child[1]->value);
+                        break;
+                    default:
+                        error = CompareOp(node->op,&val,child[1]->value);
+                        break;
+                }
+                if( error == NULL )
+                    return NewLiteral(node,val);
+            }
+            break;
+        case NODE_LOGIC:
+            if( IsLiteral(child[0]) ) {
+                Value val( child[0]->value );
+                if( LogicShortCut(node->op,&val) )
+                    return NewLiteral(node,val);
+                if( IsLiteral(child[1]) ) {
+                    LogicOp(node->op,&val,child[1]->value);
+                    return NewLiteral(node,val);
+                }
+            }
+            break;
+        case NODE_TENERY:
+            // The dead branch is dropped
+            if( IsLiteral(child[0]) )
+                return ToBool(child[0]->value) ? child[1] : child[2];
+            break;
+        default:
+            break;
+    }
+
+    if( !changed )
+        return node;
+
+    Node* copy = pool_->New(node->type,node->position);
+    copy->op = node->op;
+    copy->value = node->value;
+    copy->name = node->name;
+    copy->child.swap(child);
+    return copy;
+}
+
+bool Folder::IsConstant( const Node* node ) {
+    if( node->type == NODE_VARIABLE || node->type == NODE_CALL )
+        return false;
+    for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+        if( !IsConstant(node->child[i]) )
+            return false;
+    }
+    return true;
+}
+
+std::size_t Folder::SizeBound( const Node* node , std::size_t limit ) {
+    std::size_t size = 0;
+
+    switch( node->type ) {
+        case NODE_LIST:
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                const Node* n = node->child[i];
+                if( n->type == NODE_RANGE ) {
+                    if( n->child[0]->type != NODE_NUMBER ||
+                        n->child[1]->type != NODE_NUMBER )
+                        return limit + 1;
+                    Number fr = n->child[0]->value.GetNumber();
+                    Number en = n->child[1]->value.GetNumber();
+                    if( fr < en ) {
+                        std::size_t count;
+                        if( !RangeCount(fr,en,&count) || count > limit )
+                            return limit + 1;
+                        size += count;
+                    }
+                } else {
+                    size += SizeBound(n,limit);
+                }
+                if( size > limit )
+                    return limit + 1;
+            }
+            return size;
+        case NODE_POST: {
+            // The body is evaluated once per element
+            std::size_t count = SizeBound(node->child[0],limit);
+            std::size_t each = SizeBound(node->child[1],limit);
+            if( each != 0 && count > limit / each )
+                return limit + 1;
+            return count * each;
+        }
+        case NODE_TENERY:
+            return std::max( SizeBound(node->child[1],limit) ,
+                             SizeBound(node->child[2],limit) );
+        default:
+            return 1;
+    }
+}
+
+// Tree walking evaluator for the parsed expression. The templates are
+// evaluated by the VM , this one is kept as the reference implementation
+// that the VM is tested against.
+class Interp {
+public:
+    Interp( const StringPiece& source,
+            int pos,
+            Context* context,
+            std::string* error ):
+
+        source_(source),
+        start_position_(pos),
+        context_(context),
+        dollar_value_(NULL),
+        error_(error){}
+
+    bool DoInterp( const Node* node , Value* val ) {
+        return InterpExp(node,val);
+    }
+
+private:
+    void ReportError( const Node* node , const char* format , ... );
+
+    bool InterpList  ( const Node* node , Value* output );
+    bool InterpFunc  ( const Node* node , Value* output );
+    bool InterpVar   ( const Node* node , Value* output );
+    bool InterpUnary ( const Node* node , Value* output );
+    bool InterpBinary( const Node* node , Value* output );
+    bool InterpLogic ( const Node* node , Value* output );
+    bool InterpTenery( const Node* node , Value* output );
+    bool InterpPost  ( const Node* node , Value* output );
+    bool InterpExp   ( const Node* node , Value* output );
+
+private:
+    const StringPiece source_;
+    int start_position_;
+    Context* context_;
+    const Value* dollar_value_;
+    std::string* error_;
+};
+
+void Interp::ReportError( const Node* node , const char* format , ... )  {
+    char msg[1024];
+    va_list vlist;
+
+    va_start(vlist,format);
+    vsprintf(msg,format,vlist);
+    va_end(vlist);
+
+    FormatError(source_,start_position_,node->position,msg,error_);
+}
+
+bool Interp::InterpList( const Node* node , Value* output ) {
+    // We don't have unique_ptr in C++03, just use raw pointer but make
+    // sure we delete it in any exit statements
+    ValueList* vl = new ValueList();
+
+    for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+        const Node* n = node->child[i];
+        Value val;
+
+        if( n->type != NODE_RANGE ) {
+            if( !InterpExp(n,&val) ) {
+                delete vl;
+                return false;
+            }
+            vl->Append().Swap(&val);
+            continue;
+        }
+
+        Value to;
+        if( !InterpExp(n->child[0],&val) || !InterpExp(n->child[1],&to) ) {
+            delete vl;
+            return false;
+        }
+
+        if( to.type() != Value::VALUE_NUMBER ||
+            val.type()!= Value::VALUE_NUMBER ) {
+            delete vl;
+            // For simplicity , we currently only allows the type number
+            // to have to operator .
+            ReportError(n,"\"..\" operator can have operand number");
+            return false;
+        } else {
+            // Now expanding the fr and to range
+            Number fr = val.GetNumber();
+            Number en = to.GetNumber();
+            std::size_t count;
+            if( fr >= en ) {
+                delete vl;
+                ReportError(n,"\"..\" operator must have a strictly less than relation for its left and right operands");
+                return false;
+            }
+            if( !RangeCount(fr,en,&count) ) {
+                delete vl;
+                ReportError(n,"\"..\" operator has too many elements");
+                return false;
+            }
+            // Expanding the range to the value list elements
+            vl->Reserve( vl->size() + count );
+            for( ; fr < en ; ++fr ) {
+                vl->AddValue(fr);
+            }
+        }
+    }
+
+    output->SetList( vl );
+    return true;
+}
+
+bool Interp::InterpFunc( const Node* node , Value* output ) {
+    // Arguments are evaluated in place
+    std::vector<Value> par( node->child.size() );
+
+    for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+        if( !InterpExp(node->child[i],&par[i]) )
+            return false;
+    }
+
+    if( context_ == NULL ) {
+        ReportError(node,"Function:%s doesn't have context to be executed",
+            node->name.c_str());
+        return false;
+    } else {
+        std::string error;
+        if( !context_->ExecFunction(node->name,par,output,&error) ) {
+            ReportError(node,"Function:%s cannot be executed with error:%s",
+                node->name.c_str(),
+                error.c_str());
+            return false;
+        } else {
+            return true;
+        }
+    }
+}
+
+bool Interp::InterpVar( const Node* node , Value* output ) {
+    if( context_ == NULL ) {
+        ReportError(node,"Variable:%s doesn't have context to look up",node->name.c_str());
+        return false;
+    } else {
+        if( !context_->GetVariable(node->name,output) ) {
+            ReportError(node,"Variable:%s is not existed",node->name.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+bool Interp::InterpUnary( const Node* node , Value* output ) {
+    if(!InterpExp(node->child[0],output))
+        return false;
+
+    const char* error = UnaryOp(node->op,output);
+    if( error != NULL ) {
+        ReportError(node,"%s",error);
+        return false;
+    }
+    return true;
+}
+
+bool Interp::InterpBinary( const Node* node , Value* output ) {
+    Value rhs;
+    const char* error;
+
+    if( !InterpExp(node->child[0],output) || !InterpExp(node->child[1],&rhs) )
+        return false;
+
+    switch( node->op ) {
+        case TK_MUL:
+        case TK_DIV:
+        case TK_ADD:
+        case TK_SUB:
+            error = ArithOp(node->op,output,rhs);
+            break;
+        default:
+            error = CompareOp(node->op,output,rhs);
+            break;
+    }
+
+    if( error != NULL ) {
+        ReportError(node,"%s",error);
+        return false;
+    }
+    return true;
+}
+
+bool Interp::InterpLogic( const Node* node , Value* output ) {
+    Value rhs;
+
+    if( !InterpExp(node->child[0],output) )
+        return false;
+
+    // The right operand is skipped once the result is known
+    if( LogicShortCut(node->op,output) )
+        return true;
+
+    if( !InterpExp(node->child[1],&rhs) )
+        return false;
+
+    LogicOp(node->op,output,rhs);
+    return true;
+}
+
+bool Interp::InterpTenery( const Node* node , Value* output ) {
+    // Only the branch that is taken is evaluated
+    Value cond;
+
+    if( !InterpExp(node->child[0],&cond) )
+        return false;
+
+    return InterpExp( node->child[ ToBool(cond) ? 1 : 2 ] , output );
+}
+
+bool Interp::InterpPost( const Node* node , Value* output ) {
+    const Value* saved_dollar = dollar_value_;
+
+    if( !InterpExp(node->child[0],output) )
+        return false;
+
+    // Now set up the context value based on the type of the output value
+    if( output->type() == Value::VALUE_LIST ) {
+        // Foreach semantic goes here, the body is already parsed so we
+        // only need to evaluate it once per element. Each element is
+        // replaced by its result in place , the list is copied only if it
+        // is shared with someone else
+        ValueList* l = output->MutableList();
+
+        for( std::size_t i = 0 ; i < l->size() ; ++i ) {
+            Value new_val;
+
+            dollar_value_ = &l->Index(i);
+            if(!InterpExp(node->child[1],&new_val)) {
+                dollar_value_ = saved_dollar;
+                return false;
+            }
+            l->Index(i).Swap(&new_val);
+        }
+        dollar_value_ = saved_dollar;
+        return true;
+    } else {
+        Value new_val;
+
+        // Scalar value
+        dollar_value_ = output;
+        if( !InterpExp(node->child[1],&new_val) ) {
+            dollar_value_ = saved_dollar;
+            return false;
+        }
+        dollar_value_ = saved_dollar;
+
+        output->Swap(&new_val);
+        return true;
+    }
+}
+
+bool Interp::InterpExp( const Node* node , Value* output ) {
+    switch( node->type ) {
+        case NODE_NUMBER:
+        case NODE_STRING:
+            *output = node->value;
+            return true;
+        case NODE_DOLLAR:
+            if( dollar_value_ == NULL ) {
+                ReportError(node,"Dollar value is not set!");
+                return false;
+            } else {
+                *output = *dollar_value_;
+                return true;
+            }
+        case NODE_VARIABLE:
+            return InterpVar(node,output);
+        case NODE_CALL:
+            return InterpFunc(node,output);
+        case NODE_LIST:
+            return InterpList(node,output);
+        case NODE_UNARY:
+            return InterpUnary(node,output);
+        case NODE_BINARY:
+            return InterpBinary(node,output);
+        case NODE_LOGIC:
+            return InterpLogic(node,output);
+        case NODE_TENERY:
+            return InterpTenery(node,output);
+        case NODE_POST:
+            return InterpPost(node,output);
+        default:
+            UNREACHABLE(return false);
+    }
+}
+
+// Bytecode of the expression language. The syntax tree is compiled into a
+// compact stack based program when the template is compiled , the VM then
+// runs it with a tight dispatch loop.
+
+#define TSUB_OPCODE_LIST(__) \
+    __(OP_PUSH,"push")         /* push constant[arg] */                   \
+    __(OP_DOLLAR,"dollar")     /* push the dollar value */                \
+    __(OP_LOAD,"load")         /* push variable name[arg] */              \
+    __(OP_CALL,"call")         /* call name[arg] with argc parameters */  \
+    __(OP_LIST,"list")         /* start a new list */                     \
+    __(OP_APPEND,"append")     /* pop value and append it to the list */  \
+    __(OP_RANGE,"range")       /* pop fr,to and append the range */       \
+    __(OP_END_LIST,"end_list") /* push the finished list */               \
+    __(OP_POS,"pos")                                                      \
+    __(OP_NEG,"neg")                                                      \
+    __(OP_NOT,"not")                                                      \
+    __(OP_ADD,"add")                                                      \
+    __(OP_SUB,"sub")                                                      \
+    __(OP_MUL,"mul")                                                      \
+    __(OP_DIV,"div")                                                      \
+    __(OP_LT,"lt")                                                        \
+    __(OP_LET,"let")                                                      \
+    __(OP_GT,"gt")                                                        \
+    __(OP_GET,"get")                                                      \
+    __(OP_EQ,"eq")                                                        \
+    __(OP_NEQ,"neq")                                                      \
+    __(OP_AND,"and")                                                      \
+    __(OP_OR,"or")                                                        \
+    __(OP_JUMP,"jump")         /* jump to arg */                          \
+    __(OP_JUMP_FALSE,"jump_false") /* pop cond and jump to arg if false */ \
+    __(OP_AND_SKIP,"and_skip") /* jump to arg if && is decided */         \
+    __(OP_OR_SKIP,"or_skip")   /* jump to arg if || is decided */         \
+    __(OP_POST,"post")         /* map top value with body at arg */       \
+    __(OP_RET,"ret")
+
+enum OpCode {
+#define _DO(op,name) op,
+    TSUB_OPCODE_LIST(_DO)
+#undef _DO
+    OP_COUNT
+};
+
+// Computed goto is used for dispatching when the compiler supports it
+#if defined(__GNUC__) && !defined(TSUB_NO_COMPUTED_GOTO)
+#define TSUB_COMPUTED_GOTO
+#endif
+
+// Post body that is pure number arithmetic on $ . Such body is mapped over
+// a list one operation at a time on plain number arrays instead of running
+// the bytecode once per element. Each loop only collects the overflow flags
+// of its elements and checks them once at the end.
+class MapKernel {
+public:
+    enum {
+        K_DOLLAR,
+        K_CONST,
+        K_ADD,
+        K_SUB,
+        K_MUL,
+        K_DIV,
+        K_NEG
+    };
+
+    struct Op {
+        int op;
+        Number value;
+    };
+
+    MapKernel():
+        max_stack_(0),
+        affine_(false)
+        {}
+
+    // Build the kernel from the body , fails if the body is not pure
+    // number arithmetic
+    bool Build( const Node* node ) {
+        int depth = 0;
+        ops_.clear();
+        max_stack_ = 0;
+        if( !BuildNode(node,&depth) )
+            return false;
+        BuildAffine();
+        return true;
+    }
+
+    // Run the kernel over the input , fails when divide zero or overflow
+    // happens so the caller can fall back to the bytecode to report the error
+    bool Run( const std::vector<Number>& input ,
+              std::vector< std::vector<Number> >* stack ) const;
+
+    // Whether the body is scale*$+offset , such body maps a range to
+    // another range without touching any element
+    bool affine() const {
+        return affine_;
+    }
+
+    // Map the range start , start+step , ... of count numbers by the affine
+    // body , fails if the body overflows for any of the numbers
+    bool MapRange( Number start , Number step , std::size_t count ,
+                   Number* new_start , Number* new_step ) const;
+
+private:
+    // Value a*$+b of an operation , in terms of $
+    struct Term {
+        Number a;
+        Number b;
+
+        // Value of the term for $ = x , false on overflow
+        bool At( Number x , Number* output ) const {
+            Number ax;
+            return CheckedMul(a,x,&ax) && CheckedAdd(ax,b,output);
+        }
+    };
+
+    bool BuildNode( const Node* node , int* depth );
+    void BuildAffine();
+
+    void Push( int op , Number value , int* depth ) {
+        Op o;
+        o.op = op;
+        o.value = value;
+        ops_.push_back(o);
+
+        if( op == K_DOLLAR || op == K_CONST ) {
+            max_stack_ = std::max( max_stack_ , ++(*depth) );
+        } else if( op != K_NEG ) {
+            --(*depth);
+        }
+    }
+
+private:
+    std::vector<Op> ops_;
+    int max_stack_;
+
+    bool affine_;
+
+    // Result of each operation of the affine body , the last one is the
+    // body itself. Since each of them is linear in $ , it could only
+    // overflow for some number of a range if it overflows at either end.
+    std::vector<Term> term_;
+};
+
+bool MapKernel::BuildNode( const Node* node , int* depth ) {
+    switch( node->type ) {
+        case NODE_DOLLAR:
+            Push(K_DOLLAR,0,depth);
+            return true;
+        case NODE_NUMBER:
+            Push(K_CONST,node->value.GetNumber(),depth);
+            return true;
+        case NODE_UNARY:
+            if( node->op == TK_NOT || !BuildNode(node->child[0],depth) )
+                return false;
+            if( node->op == TK_SUB )
+                Push(K_NEG,0,depth);
+            return true;
+        case NODE_BINARY: {
+            int op;
+            switch( node->op ) {
+                case TK_ADD: op = K_ADD; break;
+                case TK_SUB: op = K_SUB; break;
+                case TK_MUL: op = K_MUL; break;
+                case TK_DIV: op = K_DIV; break;
+                default: return false;
+            }
+            if( !BuildNode(node->child[0],depth) || !BuildNode(node->child[1],depth) )
+                return false;
+            Push(op,0,depth);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+void MapKernel::BuildAffine() {
+    // Evaluate the body symbolically , each stack slot is a*$+b . A body
+    // whose coefficients overflow is left to the kernel loops
+    std::vector<Term> stack;
+
+    affine_ = false;
+    term_.clear();
+    for( std::size_t i = 0 ; i < ops_.size() ; ++i ) {
+        const Op& o = ops_[i];
+        Term t;
+
+        switch( o.op ) {
+            case K_DOLLAR:
+                t.a = 1; t.b = 0;
+                stack.push_back(t);
+                continue;
+            case K_CONST:
+                t.a = 0; t.b = o.value;
+                stack.push_back(t);
+                continue;
+            case K_NEG:
+                if( !CheckedNeg(stack.back().a,&stack.back().a) ||
+                    !CheckedNeg(stack.back().b,&stack.back().b) )
+                    return;
+                term_.push_back(stack.back());
+                continue;
+            default:
+                break;
+        }
+
+        Term r = stack.back();
+        stack.pop_back();
+        Term& l = stack.back();
+
+        switch( o.op ) {
+            case K_ADD:
+                if( !CheckedAdd(l.a,r.a,&t.a) || !CheckedAdd(l.b,r.b,&t.b) )
+                    return;
+                break;
+            case K_SUB:
+                if( !CheckedSub(l.a,r.a,&t.a) || !CheckedSub(l.b,r.b,&t.b) )
+                    return;
+                break;
+            case K_MUL: {
+                // One side is a constant
+                if( l.a != 0 && r.a != 0 )
+                    return;
+                const Term& c = l.a == 0 ? l : r;
+                const Term& v = l.a == 0 ? r : l;
+                if( !CheckedMul(v.a,c.b,&t.a) || !CheckedMul(v.b,c.b,&t.b) )
+                    return;
+                break;
+            }
+            default:
+                // Division is not affine
+                return;
+        }
+        l = t;
+        term_.push_back(t);
+    }
+
+    // A body of $ alone , or a constant
+    if( term_.empty() )
+        term_.push_back(stack.back());
+    affine_ = true;
+}
+
+bool MapKernel::MapRange( Number start , Number step , std::size_t count ,
+                          Number* new_start , Number* new_step ) const {
+    assert( affine_ && count > 0 );
+    Number last = static_cast<Number>( static_cast<UNumber>(start) +
+        static_cast<UNumber>(count-1) * static_cast<UNumber>(step) );
+    Number value;
+
+    for( std::size_t i = 0 ; i < term_.size() ; ++i ) {
+        if( !term_[i].At(start,&value) || !term_[i].At(last,&value) )
+            return false;
+    }
+
+    // The new step may not fit when it is only taken once or twice , it
+    // wraps around like ValueList::RangeAt which gives the right numbers
+    const Term& body = term_.back();
+    body.At(start,new_start);
+    *new_step = static_cast<Number>( static_cast<UNumber>(body.a) * static_cast<UNumber>(step) );
+    return true;
+}
+
+bool MapKernel::Run( const std::vector<Number>& input ,
+                     std::vector< std::vector<Number> >* stack ) const {
+    const std::size_t n = input.size();
+    int sp = 0;
+    bool ok = true;
+
+    if( stack->size() < static_cast<std::size_t>(max_stack_) )
+        stack->resize(max_stack_);
+
+    for( std::size_t i = 0 ; i < ops_.size() ; ++i ) {
+        const Op& o = ops_[i];
+
+        if( o.op == K_DOLLAR ) {
+            (*stack)[sp++] = input;
+            continue;
+        } else if( o.op == K_CONST ) {
+            (*stack)[sp++].assign(n,o.value);
+            continue;
+        } else if( o.op == K_NEG ) {
+            Number* a = &((*stack)[sp-1][0]);
+            for( std::size_t k = 0 ; k < n ; ++k )
+                ok &= CheckedNeg(a[k],&a[k]);
+            if( !ok )
+                return false;
+            continue;
+        }
+
+        Number* a = &((*stack)[sp-2][0]);
+        const Number* b = &((*stack)[sp-1][0]);
+        --sp;
+
+        switch( o.op ) {
+            case K_ADD:
+                for( std::size_t k = 0 ; k < n ; ++k )
+                    ok &= CheckedAdd(a[k],b[k],&a[k]);
+                break;
+            case K_SUB:
+                for( std::size_t k = 0 ; k < n ; ++k )
+                    ok &= CheckedSub(a[k],b[k],&a[k]);
+                break;
+            case K_MUL:
+                for( std::size_t k = 0 ; k < n ; ++k )
+                    ok &= CheckedMul(a[k],b[k],&a[k]);
+                break;
+            case K_DIV:
+                for( std::size_t k = 0 ; k < n ; ++k ) {
+                    if( b[k] == 0 )
+                        return false;
+                }
+                for( std::size_t k = 0 ; k < n ; ++k )
+                    ok &= CheckedDiv(a[k],b[k],&a[k]);
+                break;
+            default:
+                UNREACHABLE(return false);
+        }
+        if( !ok )
+            return false;
+    }
+
+    assert( sp == 1 );
+    return true;
+}
+
+// Names of the variables and functions that a template references. Each
+// name is interned once at compile time and identified by its index.
+class SymbolTable {
+public:
+    SymbolTable() {}
+
+    int Intern( const std::string& name ) {
+        std::map<std::string,int>::iterator ib = index_.find(name);
+        if( ib != index_.end() )
+            return ib->second;
+
+        name_.push_back(name);
+        index_.insert( std::make_pair( name , static_cast<int>(name_.size()) - 1 ) );
+        return static_cast<int>(name_.size()) - 1;
+    }
+
+    const std::string& name( int index ) const {
+        return name_[index];
+    }
+
+    // Index of the name or -1 if it is not referenced
+    int Find( const std::string& name ) const {
+        std::map<std::string,int>::const_iterator ib = index_.find(name);
+        return ib == index_.end() ? -1 : ib->second;
+    }
+
+    std::size_t size() const {
+        return name_.size();
+    }
+
+private:
+    std::vector<std::string> name_;
+    std::map<std::string,int> index_;
+};
+
+// Symbols of a template bound to a context. Each symbol is resolved by the
+// context on its first use , later lookups are just an array access and the
+// id based interface of the context.
+class SymbolBinding {
+public:
+    SymbolBinding( const SymbolTable& table , Context* context ):
+        table_(&table),
+        context_(context),
+        id_(table.size(),UNRESOLVED)
+        {}
+
+    // Bind the symbols of another template to the same context
+    void Reset( const SymbolTable& table ) {
+        table_ = &table;
+        id_.assign(table.size(),UNRESOLVED);
+    }
+
+    Context* context() const {
+        return context_;
+    }
+
+    const std::string& name( int index ) const {
+        return table_->name(index);
+    }
+
+    bool GetVariable( int index , Value* output ) {
+        Context::SymbolId id = Resolve(index);
+        if( id == Context::NO_SYMBOL )
+            return context_->GetVariable(table_->name(index),output);
+        else
+            return context_->GetVariableById(id,output);
+    }
+
+    bool ExecFunction( int index ,
+                       const std::vector<Value>& par ,
+                       Value* ret ,
+                       std::string* error ) {
+        Context::SymbolId id = Resolve(index);
+        if( id == Context::NO_SYMBOL )
+            return context_->ExecFunction(table_->name(index),par,ret,error);
+        else
+            return context_->ExecFunctionById(id,par,ret,error);
+    }
+
+private:
+    enum {
+        UNRESOLVED = -2
+    };
+
+    Context::SymbolId Resolve( int index ) {
+        if( id_[index] == UNRESOLVED )
+            id_[index] = context_->Resolve(table_->name(index));
+        return id_[index];
+    }
+
+private:
+    const SymbolTable* table_;
+    Context* context_;
+    std::vector<Context::SymbolId> id_;
+};
+
+class Program {
+public:
+    struct Instruction {
+        unsigned short op;
+        unsigned short argc;
+        int arg;
+    };
+
+    Program():
+        max_stack_(0)
+        {}
+
+    const std::vector<Instruction>& code() const {
+        return code_;
+    }
+
+    const Value& constant( int index ) const {
+        return constant_[index];
+    }
+
+    int position( std::size_t pc ) const {
+        return position_[pc];
+    }
+
+    int max_stack() const {
+        return max_stack_;
+    }
+
+    // Approximate number of bytes used by the program
+    std::size_t MemoryUsage() const {
+        return code_.size() * ( sizeof(Instruction) + sizeof(int) ) +
+               constant_.size() * sizeof(Value) +
+               kernel_.size() * sizeof(MapKernel);
+    }
+
+    // Kernel of the post body , index is stored in argc of OP_POST and 0
+    // means the body has no kernel
+    const MapKernel* kernel( int index ) const {
+        return index == 0 ? NULL : &kernel_[index-1];
+    }
+
+private:
+    // Instruction stream , the main body comes first and each post body
+    // follows it and ends with its own OP_RET
+    std::vector<Instruction> code_;
+
+    // Source position of each instruction , only used to report error
+    std::vector<int> position_;
+
+    // Literal values , variable and function names are kept in the
+    // symbol table of the template
+    std::vector<Value> constant_;
+
+    // Kernels of the post bodies
+    std::vector<MapKernel> kernel_;
+
+    // The stack depth that is needed to run this program
+    int max_stack_;
+
+    friend class CodeGen;
+};
+
+class CodeGen {
+public:
+    CodeGen( Program* program , SymbolTable* symbol_table ):
+        program_(program),
+        symbol_table_(symbol_table)
+        {}
+
+    bool Generate( const Node* node , std::string* error );
+
+private:
+    bool GenChunk( const Node* node , std::string* error );
+    bool GenExp( const Node* node , std::string* error );
+    int Emit( int op , const Node* node , int arg = 0 , int argc = 0 );
+
+    // Point the jump instruction to the next instruction
+    void Patch( int jump ) {
+        program_->code_[jump].arg = static_cast<int>(program_->code_.size());
+    }
+
+    static int StackSize( const Node* node );
+
+private:
+    // Post bodies that need to be generated after the current chunk
+    std::vector< std::pair<int,const Node*> > pending_;
+    Program* program_;
+    SymbolTable* symbol_table_;
+};
+
+int CodeGen::Emit( int op , const Node* node , int arg , int argc ) {
+    Program::Instruction ins;
+    ins.op = static_cast<unsigned short>(op);
+    ins.argc = static_cast<unsigned short>(argc);
+    ins.arg = arg;
+    program_->code_.push_back(ins);
+    program_->position_.push_back(node->position);
+    return static_cast<int>(program_->code_.size()) - 1;
+}
+
+int CodeGen::StackSize( const Node* node ) {
+    // The stack slots needed to evaluate the node , the result included
+    int size = 1;
+
+    switch( node->type ) {
+        case NODE_TENERY:
+            // The condition is popped before the branch runs
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                size = std::max( size , StackSize(node->child[i]) );
+            }
+            return size;
+        case NODE_CALL:
+        case NODE_LIST:
+            // Parameters stay on the stack until the call , list elements
+            // are appended once they are evaluated
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                int base = node->type == NODE_CALL ? static_cast<int>(i) : 0;
+                size = std::max( size , base + StackSize(node->child[i]) );
+            }
+            return size;
+        default:
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                size = std::max( size , static_cast<int>(i) + StackSize(node->child[i]) );
+            }
+            return size;
+    }
+}
+
+bool CodeGen::Generate( const Node* node , std::string* error ) {
+    program_->max_stack_ = StackSize(node);
+
+    if( !GenChunk(node,error) )
+        return false;
+
+    // Each post body is generated as a separate chunk, the body may have
+    // its own post bodies so keep going until nothing is pending
+    while( !pending_.empty() ) {
+        std::pair<int,const Node*> body = pending_.back();
+        pending_.pop_back();
+
+        program_->code_[body.first].arg = static_cast<int>(program_->code_.size());
+        if( !GenChunk(body.second,error) )
+            return false;
+    }
+    return true;
+}
+
+bool CodeGen::GenChunk( const Node* node , std::string* error ) {
+    if( !GenExp(node,error) )
+        return false;
+    Emit(OP_RET,node);
+    return true;
+}
+
+bool CodeGen::GenExp( const Node* node , std::string* error ) {
+    switch( node->type ) {
+        case NODE_NUMBER:
+        case NODE_STRING:
+            program_->constant_.push_back(node->value);
+            Emit(OP_PUSH,node,static_cast<int>(program_->constant_.size())-1);
+            return true;
+        case NODE_DOLLAR:
+            Emit(OP_DOLLAR,node);
+            return true;
+        case NODE_VARIABLE:
+            Emit(OP_LOAD,node,symbol_table_->Intern(node->name));
+            return true;
+        case NODE_CALL:
+            if( node->child.size() > 0xffff ) {
+                error->assign("[Module:CodeGen]:Too many parameters for function ");
+                error->append(node->name);
+                return false;
+            }
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                if( !GenExp(node->child[i],error) )
+                    return false;
+            }
+            Emit(OP_CALL,node,symbol_table_->Intern(node->name),static_cast<int>(node->child.size()));
+            return true;
+        case NODE_LIST:
+            Emit(OP_LIST,node);
+            for( std::size_t i = 0 ; i < node->child.size() ; ++i ) {
+                const Node* n = node->child[i];
+                if( n->type == NODE_RANGE ) {
+                    if( !GenExp(n->child[0],error) || !GenExp(n->child[1],error) )
+                        return false;
+                    Emit(OP_RANGE,n);
+                } else {
+                    if( !GenExp(n,error) )
+                        return false;
+                    Emit(OP_APPEND,n);
+                }
+            }
+            Emit(OP_END_LIST,node);
+            return true;
+        case NODE_UNARY:
+            if( !GenExp(node->child[0],error) )
+                return false;
+            Emit( node->op == TK_ADD ? OP_POS : (node->op == TK_SUB ? OP_NEG : OP_NOT) , node );
+            return true;
+        case NODE_LOGIC: {
+            // Short circuit , the skip instruction jumps over the right
+            // operand when the left operand decides the result
+            if( !GenExp(node->child[0],error) )
+                return false;
+            int skip = Emit( node->op == TK_AND ? OP_AND_SKIP : OP_OR_SKIP , node );
+            if( !GenExp(node->child[1],error) )
+                return false;
+            Emit( node->op == TK_AND ? OP_AND : OP_OR , node );
+            Patch(skip);
+            return true;
+        }
+        case NODE_BINARY: {
+            if( !GenExp(node->child[0],error) || !GenExp(node->child[1],error) )
+                return false;
+            int op;
+            switch( node->op ) {
+                case TK_ADD: op = OP_ADD; break;
+                case TK_SUB: op = OP_SUB; break;
+                case TK_MUL: op = OP_MUL; break;
+                case TK_DIV: op = OP_DIV; break;
+                case TK_LT:  op = OP_LT;  break;
+                case TK_LET: op = OP_LET; break;
+                case TK_GT:  op = OP_GT;  break;
+                case TK_GET: op = OP_GET; break;
+                case TK_EQ:  op = OP_EQ;  break;
+                case TK_NEQ: op = OP_NEQ; break;
+                default: UNREACHABLE(return false);
+            }
+            Emit(op,node);
+            return true;
+        }
+        case NODE_TENERY: {
+            // Only the branch that is taken is evaluated
+            if( !GenExp(node->child[0],error) )
+                return false;
+            int jump_false = Emit(OP_JUMP_FALSE,node);
+            if( !GenExp(node->child[1],error) )
+                return false;
+            int jump = Emit(OP_JUMP,node);
+            Patch(jump_false);
+            if( !GenExp(node->child[2],error) )
+                return false;
+            Patch(jump);
+            return true;
+        }
+        case NODE_POST: {
+            MapKernel kernel;
+            int index = 0;
+
+            if( !GenExp(node->child[0],error) )
+                return false;
+
+            if( kernel.Build(node->child[1]) ) {
+                program_->kernel_.push_back(kernel);
+                index = static_cast<int>(program_->kernel_.size());
+            }
+            pending_.push_back( std::make_pair( Emit(OP_POST,node,0,index) , node->child[1] ) );
+            return true;
+        }
+        default:
+            UNREACHABLE(return false);
+    }
+}
+
+// Stack based virtual machine that runs the program. It is cheap to
+// construct and holds no state that outlives a single evaluation.
+class VM {
+public:
+    VM( SymbolBinding* binding ,
+        std::string* error ):
+
+        program_(NULL),
+        source_(NULL),
+        start_position_(0),
+        binding_(binding),
+        error_(error){}
+
+    ~VM() {
+        ClearList();
+    }
+
+    // Execute the program , the VM could run many programs one by one and
+    // its buffers are reused by all of them
+    bool DoExecute( const Program& program ,
+                    const std::string& source ,
+                    int pos ,
+                    Value* output ) {
+        program_ = &program;
+        source_ = &source;
+        start_position_ = pos;
+
+        // Lists left by a failed execution
+        ClearList();
+
+        if( stack_.size() < static_cast<std::size_t>(program.max_stack()) )
+            stack_.resize( program.max_stack() );
+        return Execute(0,0,NULL,output);
+    }
+
+private:
+    void ClearList() {
+        for( std::size_t i = 0 ; i < list_.size() ; ++i )
+            delete list_[i];
+        list_.clear();
+    }
+
+    bool Execute( int pc , int sp , const Value* dollar , Value* output );
+    bool RunKernel( const MapKernel* kernel , Value* target );
+    void ReportError( const Program::Instruction* ins , const char* format , ... );
+
+private:
+    const Program* program_;
+    const std::string* source_;
+    int start_position_;
+    SymbolBinding* binding_;
+    std::string* error_;
+
+    // Operand stack , it is sized once before the execution so pointers
+    // into it stay valid while the post body is running
+    std::vector<Value> stack_;
+
+    // Lists that are being built
+    std::vector<ValueList*> list_;
+
+    // Parameters buffer for function call
+    std::vector<Value> par_;
+
+    // Buffers for running the map kernel
+    std::vector<Number> kernel_input_;
+    std::vector< std::vector<Number> > kernel_stack_;
+};
+
+bool VM::RunKernel( const MapKernel* kernel , Value* target ) {
+    const ValueList& l = target->GetList();
+
+    // Mapping an empty list gives an empty list
+    if( l.size() == 0 )
+        return true;
+
+    // The range is mapped to another range , unless some of its numbers
+    // overflow , then the kernel loops find out which one does
+    Number start = 0 , step = 0;
+    if( l.IsRange() && kernel->affine() &&
+        kernel->MapRange( l.range_start() , l.range_step() , l.size() , &start , &step ) ) {
+        target->MutableList()->SetRange( start , step , l.size() );
+        return true;
+    }
+
+    kernel_input_.resize( l.size() );
+    if( l.IsRange() ) {
+        for( std::size_t i = 0 ; i < l.size() ; ++i )
+            kernel_input_[i] = l.RangeAt(i);
+    } else {
+        for( std::size_t i = 0 ; i < l.size() ; ++i ) {
+            const Value& v = l.Element(i);
+            if( v.type() != Value::VALUE_NUMBER )
+                return false;
+            kernel_input_[i] = v.GetNumber();
+        }
+    }
+
+    if( !kernel->Run(kernel_input_,&kernel_stack_) )
+        return false;
+
+    // Numbers are written back in place , a range becomes a normal list
+    const std::vector<Number>& result = kernel_stack_[0];
+    ValueList* new_list = target->MutableList();
+    if( new_list->IsRange() ) {
+        new_list->Clear();
+        new_list->Reserve( result.size() );
+        for( std::size_t i = 0 ; i < result.size() ; ++i )
+            new_list->AddValue(result[i]);
+    } else {
+        for( std::size_t i = 0 ; i < result.size() ; ++i )
+            new_list->Index(i).SetNumber(result[i]);
+    }
+    return true;
+}
+
+void VM::ReportError( const Program::Instruction* ins , const char* format , ... ) {
+    char msg[1024];
+    va_list vlist;
+
+    va_start(vlist,format);
+    vsprintf(msg,format,vlist);
+    va_end(vlist);
+
+    std::size_t pc = ins - &(program_->code()[0]);
+    FormatError(StringPiece(*source_),start_position_,program_->position(pc),msg,error_);
+}
+
+#ifdef TSUB_COMPUTED_GOTO
+#define VM_CASE(op) LABEL_##op:
+#define VM_DISPATCH() do { ins = code + pc++; goto *kDispatch[ins->op]; } while(0)
+#else
+#define VM_CASE(op) case op:
+#define VM_DISPATCH() break
+#endif
+
+// Arithmetic and comparison have an inlined fast path for numbers , the
+// shared helpers handle the rest and produce the error message.
+#define VM_BINARY(tk,expr,helper) \
+    { \
+        Value& lhs = stack[sp-2]; \
+        const Value& rhs = stack[sp-1]; \
+        if( lhs.type() == Value::VALUE_NUMBER && \
+            rhs.type() == Value::VALUE_NUMBER && (expr) ) { \
+        } else { \
+            const char* error = helper(tk,&lhs,rhs); \
+            if( error != NULL ) { \
+                ReportError(ins,"%s",error); \
+                return false; \
+            } \
+        } \
+        --sp; \
+    }
+
+#define VM_NUMBER(expr) (lhs.SetNumber(expr),true)
+
+// Checked arithmetic of two numbers , an overflow falls back to the helper
+// which reports it
+#define VM_CHECKED(fn) (fn(lhs.GetNumber(),rhs.GetNumber(),&number) && VM_NUMBER(number))
+
+bool VM::Execute( int pc , int sp , const Value* dollar , Value* output ) {
+    const Program::Instruction* code = &(program_->code()[0]);
+    const Program::Instruction* ins;
+    Value* stack = &(stack_[0]);
+    Number number;
+
+#ifdef TSUB_COMPUTED_GOTO
+    static const void* kDispatch[] = {
+#define _DO(op,name) &&LABEL_##op,
+        TSUB_OPCODE_LIST(_DO)
+#undef _DO
+    };
+
+    VM_DISPATCH();
+#else
+    for( ;; ) {
+        ins = code + pc++;
+        switch( ins->op ) {
+#endif
+
+    VM_CASE(OP_PUSH) {
+        stack[sp++] = program_->constant(ins->arg);
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_DOLLAR) {
+        if( dollar == NULL ) {
+            ReportError(ins,"Dollar value is not set!");
+            return false;
+        }
+        stack[sp++] = *dollar;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_LOAD) {
+        if( binding_->context() == NULL ) {
+            ReportError(ins,"Variable:%s doesn't have context to look up",
+                binding_->name(ins->arg).c_str());
+            return false;
+        }
+        stack[sp].SetNull();
+        if( !binding_->GetVariable(ins->arg,&stack[sp]) ) {
+            ReportError(ins,"Variable:%s is not existed",
+                binding_->name(ins->arg).c_str());
+            return false;
+        }
+        ++sp;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_CALL) {
+        std::string error;
+
+        // Arguments are moved off the stack , they are dead after the call
+        sp -= ins->argc;
+        par_.resize( ins->argc );
+        for( int i = 0 ; i < ins->argc ; ++i )
+            par_[i].Swap( &stack[sp+i] );
+
+        if( binding_->context() == NULL ) {
+            ReportError(ins,"Function:%s doesn't have context to be executed",
+                binding_->name(ins->arg).c_str());
+            return false;
+        }
+        stack[sp].SetNull();
+        if( !binding_->ExecFunction(ins->arg,par_,&stack[sp],&error) ) {
+            ReportError(ins,"Function:%s cannot be executed with error:%s",
+                binding_->name(ins->arg).c_str(),
+                error.c_str());
+            return false;
+        }
+        ++sp;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_LIST) {
+        list_.push_back( new ValueList() );
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_APPEND) {
+        list_.back()->Append().Swap( &stack[--sp] );
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_RANGE) {
+        const Value& val = stack[sp-2];
+        const Value& to = stack[sp-1];
+        sp -= 2;
+
+        if( to.type() != Value::VALUE_NUMBER ||
+            val.type()!= Value::VALUE_NUMBER ) {
+            ReportError(ins,"\"..\" operator can have operand number");
+            return false;
+        }
+
+        Number fr = val.GetNumber();
+        Number en = to.GetNumber();
+        std::size_t count;
+        if( fr >= en ) {
+            ReportError(ins,"\"..\" operator must have a strictly less than relation for its left and right operands");
+            return false;
+        }
+        if( !RangeCount(fr,en,&count) ) {
+            ReportError(ins,"\"..\" operator has too many elements");
+            return false;
+        }
+
+        // A list that is only a range is kept symbolic
+        ValueList* vl = list_.back();
+        if( vl->size() == 0 ) {
+            vl->SetRange(fr,1,count);
+        } else {
+            vl->Reserve( vl->size() + count );
+            for( ; fr < en ; ++fr ) {
+                vl->AddValue(fr);
+            }
+        }
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_END_LIST) {
+        stack[sp++].SetList( list_.back() );
+        list_.pop_back();
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_POS) {
+        if( stack[sp-1].type() != Value::VALUE_NUMBER ) {
+            ReportError(ins,"%s",UnaryOp(TK_ADD,&stack[sp-1]));
+            return false;
+        }
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_NEG) {
+        const char* error = UnaryOp(TK_SUB,&stack[sp-1]);
+        if( error != NULL ) {
+            ReportError(ins,"%s",error);
+            return false;
+        }
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_NOT) {
+        UnaryOp(TK_NOT,&stack[sp-1]);
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_ADD) VM_BINARY(TK_ADD,VM_CHECKED(CheckedAdd),ArithOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_SUB) VM_BINARY(TK_SUB,VM_CHECKED(CheckedSub),ArithOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_MUL) VM_BINARY(TK_MUL,VM_CHECKED(CheckedMul),ArithOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_DIV) VM_BINARY(TK_DIV,rhs.GetNumber() != 0 && VM_CHECKED(CheckedDiv),ArithOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_LT) VM_BINARY(TK_LT,VM_NUMBER(lhs.GetNumber()<rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_LET) VM_BINARY(TK_LET,VM_NUMBER(lhs.GetNumber()<=rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_GT) VM_BINARY(TK_GT,VM_NUMBER(lhs.GetNumber()>rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_GET) VM_BINARY(TK_GET,VM_NUMBER(lhs.GetNumber()>=rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_EQ) VM_BINARY(TK_EQ,VM_NUMBER(lhs.GetNumber()==rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_NEQ) VM_BINARY(TK_NEQ,VM_NUMBER(lhs.GetNumber()!=rhs.GetNumber()),CompareOp)
+    VM_DISPATCH();
+
+    VM_CASE(OP_AND) {
+        LogicOp(TK_AND,&stack[sp-2],stack[sp-1]);
+        --sp;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_OR) {
+        LogicOp(TK_OR,&stack[sp-2],stack[sp-1]);
+        --sp;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_JUMP) {
+        pc = ins->arg;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_JUMP_FALSE) {
+        if( !ToBool(stack[--sp]) )
+            pc = ins->arg;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_AND_SKIP) {
+        if( LogicShortCut(TK_AND,&stack[sp-1]) )
+            pc = ins->arg;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_OR_SKIP) {
+        if( LogicShortCut(TK_OR,&stack[sp-1]) )
+            pc = ins->arg;
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_POST) {
+        Value& target = stack[sp-1];
+
+        const MapKernel* kernel = program_->kernel(ins->argc);
+
+        if( target.type() == Value::VALUE_LIST &&
+            kernel != NULL && RunKernel(kernel,&target) ) {
+            // The whole list is mapped by the kernel
+        } else if( target.type() == Value::VALUE_LIST ) {
+            // Foreach semantic goes here , the body runs on top of the
+            // list so the elements are never moved while being used. Each
+            // element is replaced by its result in place
+            ValueList* l = target.MutableList();
+
+            for( std::size_t i = 0 ; i < l->size() ; ++i ) {
+                Value new_val;
+                if( !Execute(ins->arg,sp,&l->Index(i),&new_val) )
+                    return false;
+                l->Index(i).Swap(&new_val);
+            }
+        } else {
+            Value new_val;
+            if( !Execute(ins->arg,sp,&target,&new_val) )
+                return false;
+            target.Swap(&new_val);
+        }
+    }
+    VM_DISPATCH();
+
+    VM_CASE(OP_RET) {
+        output->Swap( &stack[sp-1] );
+        return true;
+    }
+
+#ifndef TSUB_COMPUTED_GOTO
+        default:
+            UNREACHABLE(return false);
+        }
+    }
+#endif
+}
+
+#undef VM_NUMBER
+#undef VM_CHECKED
+#undef VM_BINARY
+#undef VM_DISPATCH
+#undef VM_CASE
+
+#ifndef NDEBUG
+void TestScanner() {
+    std::string txt = "(),+-*/ ><>=>===!= ! && ||";
+    Scanner scanner(StringPiece(txt),0);
+
+    do {
+        Lexme tk = scanner.Next();
+        if (tk.token == TK_EOF)
+            break;
+        std::cout<< GetTokenName(tk.token) << std::endl;
+        scanner.Move();
+
+    } while(true);
+    std::cout<<"We are done!"<<std::endl;
+}
+
+class TestContext : public Context {
+public:
+    TestContext():
+        calls(0)
+        {}
+
+    virtual bool GetVariable( const std::string& var , Value* val ) {
+        assert(var == "abcd");
+        val->SetNumber(5);
+        return true;
+    }
+
+    virtual bool ExecFunction( const std::string& func_name ,
+                               const std::vector<Value>& par ,
+                               Value* ret ,
+                               std::string* error ) {
+        assert( func_name == "func" );
+        ++calls;
+        ret->SetNumber( par[0].GetNumber() + 1 );
+        return true;
+    }
+
+    // Number of function calls
+    int calls;
+};
+
+void TestInterp() {
+    std::string txt = "[1..3]{$+10}";
+    std::string err;
+    int cur_pos;
+    const Node* node;
+    NodePool pool;
+    Value ret;
+    TestContext context;
+
+    Parser parser(
+        StringPiece(txt),
+        0,
+        &pool,
+        &err);
+
+    assert( parser.DoParse(&node,&cur_pos) );
+
+    Interp interp(
+        StringPiece(txt),
+        0,
+        &context,
+        &err);
+
+    assert( interp.DoInterp(node,&ret) );
+    std::cout<<txt.substr(cur_pos)<<std::endl;
+    std::cout<<ret.GetList().Index(1).GetNumber()<<std::endl;
+}
+
+std::string DumpValue( const Value& val ) {
+    std::stringstream formatter;
+    switch( val.type() ) {
+        case Value::VALUE_STRING:
+            formatter<<'"'<<val.GetString()<<'"';
+            break;
+        case Value::VALUE_NUMBER:
+            formatter<<val.GetNumber();
+            break;
+        case Value::VALUE_LIST:
+            formatter<<'[';
+            for( std::size_t i = 0 ; i < val.GetList().size() ; ++i ) {
+                formatter<<(i ? "," : "")<<DumpValue(val.GetList().Index(i));
+            }
+            formatter<<']';
+            break;
+        default:
+            formatter<<"null";
+            break;
+    }
+    return formatter.str();
+}
+
+// Differential test , the VM must agree with the tree walking interpreter
+// on both the result and the error message
+void TestVM() {
+    static const char* kExp[] = {
+        "1+2*3-4/2",
+        "(1+2)*3",
+        "-3+ +4",
+        "!0 + !5 + !\"a\" + ![1]",
+        "1<2 && 2<=2 && 3>2 && 3>=3 && 1==1 && 1!=2",
+        "\"a\"<\"b\" || 0",
+        "0 || 0",
+        "\"s\" && 0",
+        "1 ? 2 : 3",
+        "0 ? 2 : 3{$*10}",
+        "[1..4]{$*2+1}",
+        "[1,[2,3..5],\"x\"]",
+        "[1,2]{[$,$*10]}",
+        "[1,2]{(${$+1})+$}",
+        "3{$+abcd}",
+        "func(func(1)+abcd)*2",
+        "[abcd..abcd+3]{func($)}",
+        "1/0",
+        "1+\"a\"",
+        "2*\"a\"",
+        "1<\"a\"",
+        "[1]<[2]",
+        "-\"a\"",
+        "[3..1]",
+        "[\"a\"..3]",
+        "$",
+        "[1,2]{$/0}",
+        "[1..6]{-$*3/2+(7-$)}",
+        "[1,\"a\"]{$+1}",
+        "[1,[2]]{$*2}",
+        "[0..3]{10/$}",
+        "[1..3]{5}",
+        "[0..10]{-$*3-2}",
+        "([-5..5]{$*0+7}){$*2}",
+        "[0..10]{$*$}",
+        "[1..4,9]{$+1}",
+        "([0..6]{($+1)*2-(3-$)*4}){-$}",
+        "([0..3]{$+1}){[$,$]}",
+        "1 ? abcd : 1/0",
+        "0 && func(1)",
+        "\"a\" || abcd",
+        "(2+3)*abcd-(1<2)",
+        "[1*2..3*2]{$*(1+1)}",
+        "1==1 ? [1,2]{$+abcd} : abcd",
+        "-(1/0)+abcd",
+        "9223372036854775807+1",
+        "-9223372036854775807-1",
+        "-9223372036854775807-2",
+        "(-9223372036854775807-1)/-1",
+        "-(-9223372036854775807-1)",
+        "3000000000*3000000000",
+        "4000000000*4000000000",
+        "[2000000000..2000000003]{$*$}",
+        "[0..3]{$*3000000000000000000}",
+        "[0..4]{$*3000000000000000000}",
+        "[0..3]{($+9223372036854775804)-9223372036854775804}",
+        "[0..4]{($+9223372036854775804)-9223372036854775804}",
+        "[9223372036854775800..9223372036854775807]{$+1-1}",
+        "[-9223372036854775807-1..-9223372036854775807+2]{-$}",
+        "[1..3]{$*$*4611686018427387904}",
+        "[1..3]{$*$*2305843009213693951}",
+        "[0..5]{$*2305843009213693952*2}",
+        NULL
+    };
+
+    TestContext context;
+
+    for( int i = 0 ; kExp[i] != NULL ; ++i ) {
+        std::string txt = kExp[i];
+        std::string err1, err2, err3;
+        int cur_pos;
+        const Node* node;
+        NodePool pool;
+        Program program, folded;
+        SymbolTable table;
+        Value v1, v2, v3;
+
+        Parser parser(StringPiece(txt),0,&pool,&err1);
+        assert( parser.DoParse(&node,&cur_pos) );
+        assert( static_cast<std::size_t>(cur_pos) == txt.size() );
+        assert( CodeGen(&program,&table).Generate(node,&err1) );
+        assert( CodeGen(&folded,&table).Generate(Folder(&pool).Fold(node),&err1) );
+
+        SymbolBinding binding(table,&context);
+        bool r1 = Interp(StringPiece(txt),0,&context,&err1).DoInterp(node,&v1);
+        bool r2 = VM(&binding,&err2).DoExecute(program,txt,0,&v2);
+        bool r3 = VM(&binding,&err3).DoExecute(folded,txt,0,&v3);
+
+        assert( r1 == r2 && r1 == r3 );
+        assert( err1 == err2 && err1 == err3 );
+        assert( !r1 || DumpValue(v1) == DumpValue(v2) );
+        assert( !r1 || DumpValue(v1) == DumpValue(v3) );
+    }
+}
+
+// The parser only sees the given piece of the source , which needs no NUL
+// terminator
+void TestParserPiece() {
+    static const struct {
+        const char* exp;
+        std::size_t size;
+        const char* value;
+    } kCase[] = {
+        { "1234" , 2 , "12" },
+        { "[1..3]{$*2}+" , 11 , "[2,4]" },
+        { "\"ab\\\"c\"" , 7 , "\"ab\"c\"" },
+        { "\"abc\"" , 4 , NULL },
+        { "12+3" , 3 , NULL },
+        { NULL , 0 , NULL }
+    };
+
+    for( int i = 0 ; kCase[i].exp != NULL ; ++i ) {
+        std::string err;
+        int cur_pos;
+        const Node* node;
+        NodePool pool;
+        Value val;
+        StringPiece piece( kCase[i].exp , kCase[i].size );
+
+        bool ret = Parser(piece,0,&pool,&err).DoParse(&node,&cur_pos);
+        assert( ret == (kCase[i].value != NULL) );
+        if( !ret )
+            continue;
+
+        assert( static_cast<std::size_t>(cur_pos) == kCase[i].size );
+        assert( Interp(piece,0,NULL,&err).DoInterp(node,&val) );
+        assert( DumpValue(val) == kCase[i].value );
+    }
+}
+
+// The untaken branch of tenery and the right operand of a decided logic
+// operator must not be evaluated , so they never call the context
+void TestShortCircuit() {
+    static const struct {
+        const char* exp;
+        int calls;
+    } kCase[] = {
+        { "1 ? func(1) : func(2)" , 1 },
+        { "0 ? func(1) : func(2)" , 1 },
+        { "1 ? 2 : 1/0" , 0 },
+        { "0 && func(1)" , 0 },
+        { "1 && func(1)" , 1 },
+        { "2 || func(1)" , 0 },
+        { "0 || func(1)" , 1 },
+        { "\"s\" || func(1)" , 1 },
+        { "0 && func(1) || 1 ? 1 : func(2)" , 0 },
+        { "[0,1]{ $ ? func($) : 0 }" , 1 },
+        { NULL , 0 }
+    };
+
+    for( int i = 0 ; kCase[i].exp != NULL ; ++i ) {
+        std::string txt = kCase[i].exp;
+        std::string err;
+        int cur_pos;
+        const Node* node;
+        NodePool pool;
+        Program program;
+        SymbolTable table;
+        Value val;
+        TestContext c1, c2;
+
+        Parser parser(StringPiece(txt),0,&pool,&err);
+        assert( parser.DoParse(&node,&cur_pos) );
+        assert( CodeGen(&program,&table).Generate(node,&err) );
+
+        SymbolBinding binding(table,&c2);
+        assert( Interp(StringPiece(txt),0,&c1,&err).DoInterp(node,&val) );
+        assert( VM(&binding,&err).DoExecute(program,txt,0,&val) );
+        assert( c1.calls == kCase[i].calls );
+        assert( c2.calls == kCase[i].calls );
+    }
+}
+#endif // NDEBUG
+
+}// namespace exp
+}// namespace
+
+namespace tsub {
+
+using exp::Interp;
+using exp::Parser;
+using exp::Node;
+using exp::NodePool;
+
+ValueList* Value::CopyList( const ValueList& l ) {
+    ValueList* ret = new ValueList();
+
+    if( l.IsRange() ) {
+        ret->SetRange( l.range_start() , l.range_step() , l.size() );
+        return ret;
+    }
+
+    for( std::size_t i = 0 ; i < l.size() ; ++i ) {
+        const Value& value = l.Element(i);
+        ret->AddValue(value);
+    }
+
+    return ret;
+}
+
+// Compiled form of the template. The input is split into literal text and
+// expression segments, each expression is kept as a syntax tree. Once it is
+// compiled, it is never mutated and shared by all the copies of Template.
+class TemplateImpl {
+public:
+    struct Segment {
+        // Literal text with the escape characters already processed , or
+        // the strings that a constant expression renders to
+        std::vector<std::string> text;
+        // Expression tree , NULL means this segment is a literal text
+        const Node* exp;
+        // Bytecode of the expression
+        exp::Program program;
+        // Start position of the expression inside of the source
+        int position;
+        // Earlier segment with the same expression or -1. Its string list
+        // is reused if all the functions the expression calls are pure
+        int same;
+        // Symbols of the functions that the expression calls
+        std::vector<int> function;
+        // Symbols of all the variables and functions it references , sorted
+        std::vector<int> symbol;
+
+        Segment():
+            exp(NULL),
+            position(0),
+            same(-1)
+            {}
+    };
+
+    TemplateImpl( const std::string& source ):
+        source_(source),
+        ref_count_(1)
+        {}
+
+    const std::string& source() const {
+        return source_;
+    }
+
+    const std::vector<Segment>& segments() const {
+        return segments_;
+    }
+
+    const exp::SymbolTable& symbol_table() const {
+        return symbol_table_;
+    }
+
+    // The copies of a template could be made and dropped by different
+    // threads , so the count is atomic with the thread support
+    void Retain() {
+        ++ref_count_;
+    }
+
+    void Release() {
+        if( --ref_count_ == 0 )
+            delete this;
+    }
+
+    // Approximate number of bytes used by the compiled form
+    std::size_t MemoryUsage() const;
+
+private:
+    // Source text, all the error location is computed against it
+    std::string source_;
+
+    // Segments of the template in order
+    std::vector<Segment> segments_;
+
+    // All the expression nodes
+    NodePool node_pool_;
+
+    // Variable and function names referenced by all the segments
+    exp::SymbolTable symbol_table_;
+
+#if TSUB_HAS_THREADS
+    std::atomic<int> ref_count_;
+#else
+    int ref_count_;
+#endif // TSUB_HAS_THREADS
+
+    friend class TextCompiler;
+};
+
+std::size_t TemplateImpl::MemoryUsage() const {
+    std::size_t size = sizeof(*this) + source_.size() +
+        node_pool_.size() * ( sizeof(Node) + sizeof(Node*) );
+
+    for( std::size_t i = 0 ; i < segments_.size() ; ++i ) {
+        const Segment& segment = segments_[i];
+        size += sizeof(Segment) + segment.program.MemoryUsage();
+        for( std::size_t j = 0 ; j < segment.text.size() ; ++j )
+            size += sizeof(std::string) + segment.text[j].size();
+    }
+    return size;
+}
+
+namespace {
+
+// Find the first backtick or backslash in [ptr,end) , or end if there is
+// none. Everything before it is literal text that is copied as a whole.
+const char* FindDelimiter( const char* ptr , const char* end ) {
+#ifdef TSUB_AVX2
+    const __m256i tick32 = _mm256_set1_epi8('`');
+    const __m256i slash32 = _mm256_set1_epi8('\\');
+    for( ; end - ptr >= 32 ; ptr += 32 ) {
+        __m256i chunk = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(ptr) );
+        unsigned int mask = static_cast<unsigned int>( _mm256_movemask_epi8(
+            _mm256_or_si256( _mm256_cmpeq_epi8(chunk,tick32) ,
+                             _mm256_cmpeq_epi8(chunk,slash32) ) ) );
+        if( mask != 0 )
+            return ptr + __builtin_ctz(mask);
+    }
+#endif // TSUB_AVX2
+
+#ifdef TSUB_SSE2
+    const __m128i tick = _mm_set1_epi8('`');
+    const __m128i slash = _mm_set1_epi8('\\');
+    for( ; end - ptr >= 16 ; ptr += 16 ) {
+        __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>(ptr) );
+        unsigned int mask = static_cast<unsigned int>( _mm_movemask_epi8(
+            _mm_or_si128( _mm_cmpeq_epi8(chunk,tick) ,
+                          _mm_cmpeq_epi8(chunk,slash) ) ) );
+        if( mask != 0 )
+            return ptr + __builtin_ctz(mask);
+    }
+#endif // TSUB_SSE2
+
+    for( ; ptr != end ; ++ptr ) {
+        if( *ptr == '`' || *ptr == '\\' )
+            break;
+    }
+    return ptr;
+}
+
+}// namespace
+
+// Compiler splits the input text into segments and parses each expression
+// into syntax tree. This is the only place that scans the template text.
+class TextCompiler {
+public:
+    // Max number of strings a constant segment is rendered to
+    static const std::size_t kMaxConstantSize = 256;
+
+    TextCompiler( TemplateImpl* tmpl , std::string* error_desp ):
+        tmpl_(tmpl),
+        input_(&tmpl->source_),
+        error_desp_(error_desp),
+        position_(0)
+        {}
+
+    bool Run();
+
+private:
+    bool ProcessExp( TemplateImpl::Segment* segment );
+    void AddText( std::string* text );
+    void ReportError( const char* format , ... );
+
+    // Constant expression is evaluated at compile time and the adjacent
+    // literal segments are joined , the expansion only evaluates the parts
+    // that depend on the context
+    void EvaluateConstant( TemplateImpl::Segment* segment );
+    void MergeConstant();
+    static void RenderConstant( const Value& val , std::vector<std::string>* output );
+
+    // Segments with the same expression share one evaluation
+    void ShareSegment();
+    void AppendKey( const Node* node , std::string* key , TemplateImpl::Segment* segment );
+
+    bool IsEscapeChar( int cha ) {
+        switch(cha) {
+            case '\\':
+            case '`' :
+                return true;
+            default:
+                return false;
+        }
+    }
+
+private:
+    // Template that is being compiled
+    TemplateImpl* tmpl_;
+
+    // Input string pointer
+    const std::string* input_;
+
+    // Error
+    std::string* error_desp_;
+
+    // Position
+    std::string::size_type position_;
+};
+
+void TextCompiler::ReportError( const char* format , ... ) {
+    char msg[1024];
+    va_list vlist;
+    std::stringstream formatter;
+
+    va_start(vlist,format);
+    vsprintf(msg,format,vlist);
+    va_end(vlist);
+
+    formatter<<"[Module:TextProcessor]:"<<msg;
+    *error_desp_ = formatter.str();
+}
+
+void TextCompiler::AddText( std::string* text ) {
+    if( !text->empty() ) {
+        tmpl_->segments_.push_back( TemplateImpl::Segment() );
+        tmpl_->segments_.back().text.push_back( std::string() );
+        tmpl_->segments_.back().text.back().swap(*text);
+    }
+}
+
+bool TextCompiler::ProcessExp( TemplateImpl::Segment* segment ) {
+    int new_pos;
+
+    exp::Parser parser( StringPiece(*input_) ,
+        static_cast<int>(position_) ,
+        &(tmpl_->node_pool_) ,
+        error_desp_ );
+
+    segment->position = static_cast<int>(position_);
+
+    // Now parsing the script from current position
+    if( !parser.DoParse(&(segment->exp),&new_pos) ) {
+        return false;
+    }
+
+    exp::Folder folder( &(tmpl_->node_pool_) );
+    segment->exp = folder.Fold(segment->exp);
+
+    exp::CodeGen codegen( &(segment->program) , &(tmpl_->symbol_table_) );
+    if( !codegen.Generate(segment->exp,error_desp_) ) {
+        return false;
+    }
+
+    if( static_cast<std::size_t>(new_pos) >= input_->size() ||
+        input_->at(new_pos) != '`' ) {
+        ReportError("The expression needs to be ended with \"`\"");
+        return false;
+    }
+
+    // We don't need to move this cursor, since in the mainloop the ` will
+    // be skipped by the main loop counter
+    position_ = static_cast<std::size_t>(new_pos);
+
+    EvaluateConstant(segment);
+    return true;
+}
+
+void TextCompiler::EvaluateConstant( TemplateImpl::Segment* segment ) {
+    // Large lists are left to the expansion , a range is cheaper to keep
+    // symbolic than to render
+    if( !exp::Folder::IsConstant(segment->exp) ||
+        exp::Folder::SizeBound(segment->exp,kMaxConstantSize) > kMaxConstantSize )
+        return;
+
+    // No symbol is referenced , so it needs no context. If it fails , the
+    // segment is kept and the error is reported by the expansion
+    std::string error;
+    exp::SymbolBinding binding( tmpl_->symbol_table_ , NULL );
+    exp::VM vm( &binding , &error );
+    Value val;
+
+    if( !vm.DoExecute( segment->program , *input_ , segment->position , &val ) )
+        return;
+
+    RenderConstant(val,&(segment->text));
+    segment->exp = NULL;
+    segment->program = exp::Program();
+}
+
+void TextCompiler::RenderConstant( const Value& val , std::vector<std::string>* output ) {
+    switch( val.type() ) {
+        case Value::VALUE_STRING:
+            output->push_back( val.GetString() );
+            return;
+        case Value::VALUE_NUMBER: {
+            char buf[kMaxNumberLength];
+            char* end = buf + sizeof(buf);
+            char* begin = FormatNumber(val.GetNumber(),end);
+            output->push_back( std::string(begin,end) );
+            return;
+        }
+        case Value::VALUE_LIST: {
+            const ValueList& vl = val.GetList();
+            for( std::size_t i = 0 ; i < vl.size() ; ++i )
+                RenderConstant(vl.Index(i),output);
+            return;
+        }
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+void TextCompiler::MergeConstant() {
+    std::vector<TemplateImpl::Segment>& segments = tmpl_->segments_;
+    std::vector<TemplateImpl::Segment> merged;
+
+    for( std::size_t i = 0 ; i < segments.size() ; ++i ) {
+        const TemplateImpl::Segment& segment = segments[i];
+
+        if( segment.exp == NULL && !merged.empty() && merged.back().exp == NULL ) {
+            std::vector<std::string>& prefix = merged.back().text;
+            const std::vector<std::string>& suffix = segment.text;
+
+            if( suffix.empty() ||
+                prefix.size() <= kMaxConstantSize / suffix.size() ) {
+                // The left segment varies fastest in the output
+                std::vector<std::string> text;
+                text.reserve( prefix.size() * suffix.size() );
+                for( std::size_t s = 0 ; s < suffix.size() ; ++s ) {
+                    for( std::size_t p = 0 ; p < prefix.size() ; ++p )
+                        text.push_back( prefix[p] + suffix[s] );
+                }
+                prefix.swap(text);
+                continue;
+            }
+        }
+        merged.push_back(segment);
+    }
+    segments.swap(merged);
+}
+
+bool TextCompiler::Run() {
+    std::string segment;
+    const char* begin = input_->data();
+    const char* end = begin + input_->size();
+
+    // The run loop is simple, it just tries to read the text as long as possible
+    // Once it finds a expression , then it parses that one and records it as a
+    // new segment. Then it goes back to find the text.
+
+    position_ = 0;
+    while( position_ < input_->size() ) {
+        // Copy the text up to the next special character in one go
+        const char* ptr = FindDelimiter( begin + position_ , end );
+        segment.append( begin + position_ , ptr );
+        position_ = static_cast<std::size_t>( ptr - begin );
+        if( ptr == end )
+            break;
+
+        if( *ptr == '\\' ) {
+            // Handle the escape characters in the stream , a backslash that
+            // escapes nothing is dropped
+            ++position_;
+            if( ptr + 1 != end && IsEscapeChar( ptr[1] ) ) {
+                segment.push_back( ptr[1] );
+                ++position_;
+            }
+        } else {
+            ++position_;
+
+            // We need to put the segment that we currently have to the
+            // segment list now.
+            AddText(&segment);
+
+            TemplateImpl::Segment exp;
+            if( !ProcessExp(&exp) )
+                return false;
+            tmpl_->segments_.push_back(exp);
+
+            // Skip the closing `
+            ++position_;
+        }
+    }
+
+    // Checking if the segment buffer has something we need to add
+    AddText(&segment);
+    MergeConstant();
+    ShareSegment();
+    return true;
+}
+
+void TextCompiler::ShareSegment() {
+    std::vector<TemplateImpl::Segment>& segments = tmpl_->segments_;
+    std::map<std::string,int> index;
+
+    for( std::size_t i = 0 ; i < segments.size() ; ++i ) {
+        TemplateImpl::Segment& segment = segments[i];
+        if( segment.exp == NULL )
+            continue;
+
+        std::string key;
+        AppendKey(segment.exp,&key,&segment);
+
+        std::sort( segment.symbol.begin() , segment.symbol.end() );
+        segment.symbol.erase( std::unique( segment.symbol.begin() , segment.symbol.end() ) ,
+                              segment.symbol.end() );
+
+        std::pair<std::map<std::string,int>::iterator,bool> ret =
+            index.insert( std::make_pair( key , static_cast<int>(i) ) );
+        if( !ret.second )
+            segment.same = ret.first->second;
+    }
+}
+
+void TextCompiler::AppendKey( const Node* node , std::string* key ,
+    TemplateImpl::Segment* segment ) {
+    // Same encoding means the same tree , the source positions are left out
+    char buffer[64];
+
+    sprintf(buffer,"t%d,%d,%d:",node->type,node->op,
+        static_cast<int>(node->child.size()));
+    key->append(buffer);
+
+    switch( node->type ) {
+        case exp::NODE_NUMBER:
+            key->push_back('n');
+            AppendNumber(node->value.GetNumber(),key);
+            key->push_back(';');
+            break;
+        case exp::NODE_STRING:
+            sprintf(buffer,"s%d:",static_cast<int>(node->value.GetString().size()));
+            key->append(buffer);
+            key->append(node->value.GetString());
+            break;
+        case exp::NODE_CALL:
+            segment->function.push_back( tmpl_->symbol_table_.Intern(node->name) );
+            // fall through
+        case exp::NODE_VARIABLE:
+            segment->symbol.push_back( tmpl_->symbol_table_.Intern(node->name) );
+            sprintf(buffer,"s%d:",static_cast<int>(node->name.size()));
+            key->append(buffer);
+            key->append(node->name);
+            break;
+        default:
+            break;
+    }
+
+    for( std::size_t i = 0 ; i < node->child.size() ; ++i )
+        AppendKey(node->child[i],key,segment);
+}
+
+// Expansion of a compiled template against a context. Each expression
+// segment is evaluated into a string list , the output is the cartesian
+// product of all the segment lists. The product is never materialized , it
+// is walked like an odometer and each string is generated on demand.
+class TextProcessor {
+public:
+    TextProcessor( const TemplateImpl& tmpl , Context* context , std::string* error_desp ):
+        tmpl_(&tmpl),
+        binding_(tmpl.symbol_table(),context),
+        vm_(&binding_,error_desp),
+        error_desp_(error_desp)
+        {}
+
+    // Switch to another template , the string pool and all the buffers are
+    // kept for it. The result of the previous run becomes invalid.
+    void Reset( const TemplateImpl& tmpl );
+
+    bool Run( std::vector<std::string>* output , const Options& options );
+    bool Run( Sink* sink );
+    bool Run( OutputBuffer* output , const Options& options );
+    bool Run( ExpansionImpl* output );
+
+    // Evaluate again the segments of the expansion that reference a changed
+    // symbol , changed is indexed by the symbol of the template
+    bool Update( ExpansionImpl* output , const std::vector<bool>& changed );
+
+private:
+    bool Evaluate();
+    bool EvaluateSegment( std::size_t index );
+    void CopyStringList( const StrList& input , StrList* output );
+    static bool DependsOn( const TemplateImpl::Segment& segment ,
+                           const std::vector<bool>& changed );
+    bool ProcessExp( const TemplateImpl::Segment& segment , Value* val );
+    bool IsShared( const TemplateImpl::Segment& segment ) const;
+    void GenerateResult( Sink* sink );
+    void GenerateResult( OutputBuffer* output );
+#if TSUB_HAS_THREADS
+    unsigned int WorkerSize( const Options& options , std::size_t size ) const;
+    void ParallelGenerate( std::vector<std::string>* output ,
+                           std::size_t size ,
+                           unsigned int workers );
+    void ParallelGenerate( OutputBuffer* output ,
+                           std::size_t size ,
+                           unsigned int workers );
+#endif // TSUB_HAS_THREADS
+    std::size_t ResultSize() const;
+    std::size_t ResultBytes( std::size_t separator ) const;
+
+    void ValueToStringList( const Value& val , StrList* output );
+    void RangeToStringList( const ValueList& vl , StrList* output );
+
+    // Range at least this large is not rendered until the output strings
+    // are generated , smaller one is cheaper to render once
+    static const std::size_t kLazyRangeSize = 4096;
+    StringPiece NumberToString( Number num );
+
+private:
+    // String list of each segment
+    std::vector<StrList> segment_list_;
+
+    // Real string pool
+    StringPool str_pool_;
+
+    // Compiled template
+    const TemplateImpl* tmpl_;
+
+    // Symbols of the template bound to the context , shared by all the
+    // segments so each name is resolved at most once per expansion
+    exp::SymbolBinding binding_;
+
+    // Evaluates the segments one by one
+    exp::VM vm_;
+
+    // Error
+    std::string* error_desp_;
+};
+
+// Evaluated template , see Expansion
+class ExpansionImpl {
+public:
+    explicit ExpansionImpl( const Template& tmpl ):
+        tmpl_(tmpl)
+        {}
+
+    const std::vector<StrList>& segment_list() const {
+        return segment_list_;
+    }
+
+    const Template& tmpl() const {
+        return tmpl_;
+    }
+
+private:
+    // Keeps the literal text of the template alive
+    Template tmpl_;
+
+    std::vector<StrList> segment_list_;
+    StringPool str_pool_;
+
+    friend class TextProcessor;
+};
+
+namespace {
+
+// Sink that collects all the output strings into a vector
+class VectorSink : public Sink {
+public:
+    explicit VectorSink( std::vector<std::string>* output ):
+        output_(output)
+        {}
+
+    virtual bool Emit( const std::string& str ) {
+        output_->push_back(str);
+        return true;
+    }
+
+private:
+    std::vector<std::string>* output_;
+};
+
+}// namespace
+
+StringPiece TextProcessor::NumberToString( Number num ) {
+    // Numbers are cheap to render and compare , so they are just stored
+    // without being interned
+    char buf[kMaxNumberLength];
+    char* end = buf + sizeof(buf);
+    char* begin = FormatNumber(num,end);
+    return str_pool_.Store(begin,end-begin);
+}
+
+void TextProcessor::ValueToStringList( const Value& val , StrList* output ) {
+    switch(val.type()) {
+        case Value::VALUE_STRING:
+            output->push_back( str_pool_.Intern(val.GetString()) );
+            return;
+        case Value::VALUE_NUMBER:
+            output->push_back( NumberToString(val.GetNumber()) );
+            return;
+        case Value::VALUE_LIST: {
+            const ValueList& vl = val.GetList();
+
+            if( vl.IsRange() ) {
+                RangeToStringList(vl,output);
+                return;
+            }
+
+            output->reserve( output->size() + vl.size() );
+            for( std::size_t i = 0 ; i < vl.size() ; ) {
+                const Value& v = vl.Element(i);
+
+                // Contiguous non negative numbers , typically generated
+                // by the range , are rendered by a decimal counter
+                std::size_t end = i + 1;
+                if( v.type() == Value::VALUE_NUMBER && v.GetNumber() >= 0 ) {
+                    Number next = v.GetNumber();
+                    for( ; end < vl.size() ; ++end ) {
+                        const Value& n = vl.Element(end);
+                        if( next == kMaxNumber ||
+                            n.type() != Value::VALUE_NUMBER ||
+                            n.GetNumber() != ++next )
+                            break;
+                    }
+                }
+
+                if( end - i == 1 ) {
+                    ValueToStringList(v,output);
+                } else {
+                    DecimalCounter counter(v.GetNumber());
+                    for( ; i < end ; ++i ) {
+                        output->push_back( str_pool_.Store(counter.Get()) );
+                        counter.Increment();
+                    }
+                }
+                i = end;
+            }
+            return;
+        }
+        default:
+            UNREACHABLE(return);
+    }
+}
+
+void TextProcessor::RangeToStringList( const ValueList& vl , StrList* output ) {
+    output->reserve( output->size() + vl.size() );
+
+    if( vl.range_step() == 1 && vl.range_start() >= 0 &&
+        vl.RangeAt(vl.size()-1) >= vl.range_start() ) {
+        DecimalCounter counter(vl.range_start());
+        for( std::size_t i = 0 ; i < vl.size() ; ++i ) {
+            output->push_back( str_pool_.Store(counter.Get()) );
+            counter.Increment();
+        }
+    } else {
+        for( std::size_t i = 0 ; i < vl.size() ; ++i )
+            output->push_back( NumberToString( vl.RangeAt(i) ) );
+    }
+}
+
+std::size_t TextProcessor::ResultSize() const {
+    std::size_t size;
+    if( !ProductSize(segment_list_,&size) ) {
+        // Too large to be reserved anyway
+        return 0;
+    }
+    return size;
+}
+
+std::size_t TextProcessor::ResultBytes( std::size_t separator ) const {
+    // Each string of a segment appears in size/n outputs , where n is the
+    // size of that segment list
+    const std::size_t max = static_cast<std::size_t>(-1);
+    std::size_t size = ResultSize();
+    std::size_t bytes = 0;
+
+    if( size == 0 )
+        return 0;
+
+    for( std::size_t i = 0 ; i < segment_list_.size() ; ++i ) {
+        const StrList& list = segment_list_[i];
+        std::size_t len = list.Length();
+
+        std::size_t repeat = size / list.size();
+        if( len != 0 && repeat > max / len )
+            return 0;
+        if( bytes > max - repeat * len )
+            return 0;
+        bytes += repeat * len;
+    }
+
+    if( separator != 0 && size > (max - bytes) / separator )
+        return 0;
+    return bytes + size * separator;
+}
+
+void TextProcessor::GenerateResult( Sink* sink ) {
+    std::string buffer;
+
+    for( Odometer odometer(segment_list_) ; !odometer.done() ; odometer.Next() ) {
+        buffer.clear();
+        buffer.reserve( odometer.Length() );
+        odometer.Append( &buffer );
+        if( !sink->Emit(buffer) )
+            return;
+    }
+}
+
+void TextProcessor::GenerateResult( OutputBuffer* output ) {
+    // Strings are joined in place , no temporary string is involved
+    for( Odometer odometer(segment_list_) ; !odometer.done() ; odometer.Next() ) {
+        odometer.Append( &(output->data_) );
+        if( output->has_separator_ )
+            output->data_.push_back( output->separator_ );
+        output->offset_.push_back( output->data_.size() );
+    }
+}
+
+
+bool TextProcessor::ProcessExp( const TemplateImpl::Segment& segment , Value* val ) {
+    // Now running the already compiled expression
+    return vm_.DoExecute( segment.program ,
+                          tmpl_->source() ,
+                          segment.position ,
+                          val );
+}
+
+bool TextProcessor::IsShared( const TemplateImpl::Segment& segment ) const {
+    // The earlier segment has been evaluated successfully , a variable is
+    // assumed to have the same value during one expansion
+    if( segment.same < 0 )
+        return false;
+    for( std::size_t i = 0 ; i < segment.function.size() ; ++i ) {
+        if( binding_.context() == NULL ||
+            !binding_.context()->IsPure( binding_.name(segment.function[i]) ) )
+            return false;
+    }
+    return true;
+}
+
+void TextProcessor::Reset( const TemplateImpl& tmpl ) {
+    // The names of the same template stay resolved against the context
+    if( &tmpl != tmpl_ )
+        binding_.Reset( tmpl.symbol_table() );
+    tmpl_ = &tmpl;
+    str_pool_.Clear();
+
+    // The lists keep their memory
+    for( std::size_t i = 0 ; i < segment_list_.size() ; ++i )
+        segment_list_[i].clear();
+}
+
+bool TextProcessor::Evaluate() {
+    segment_list_.resize( tmpl_->segments().size() );
+
+    for( std::size_t i = 0 ; i < segment_list_.size() ; ++i ) {
+        if( !EvaluateSegment(i) )
+            return false;
+    }
+    return true;
+}
+
+bool TextProcessor::EvaluateSegment( std::size_t index ) {
+    const TemplateImpl::Segment& segment = tmpl_->segments()[index];
+    StrList& list = segment_list_[index];
+
+    list.clear();
+
+    if( segment.exp == NULL ) {
+        // The literal text lives inside of the template, no need to put
+        // it into the string pool
+        list.reserve( segment.text.size() );
+        for( std::size_t j = 0 ; j < segment.text.size() ; ++j )
+            list.push_back( StringPiece(segment.text[j]) );
+    } else if( IsShared(segment) ) {
+        // Same expression as an earlier segment , the strings are
+        // already there
+        list = segment_list_[segment.same];
+    } else {
+        Value val;
+
+        if( !ProcessExp(segment,&val) )
+            return false;
+
+        // Convert value to string list , a large range that is the whole
+        // value of the segment is rendered lazily
+        if( val.type() == Value::VALUE_LIST && val.GetList().IsRange() &&
+            val.GetList().size() >= kLazyRangeSize ) {
+            const ValueList& vl = val.GetList();
+            list.SetRange( vl.range_start() , vl.range_step() , vl.size() );
+        } else {
+            ValueToStringList(val,&list);
+        }
+    }
+    return true;
+}
+
+bool TextProcessor::DependsOn( const TemplateImpl::Segment& segment ,
+    const std::vector<bool>& changed ) {
+    for( std::size_t i = 0 ; i < segment.symbol.size() ; ++i ) {
+        if( changed[segment.symbol[i]] )
+            return true;
+    }
+    return false;
+}
+
+void TextProcessor::CopyStringList( const StrList& input , StrList* output ) {
+    if( input.IsRange() ) {
+        *output = input;
+        return;
+    }
+
+    output->clear();
+    output->reserve( input.size() );
+    for( std::size_t i = 0 ; i < input.size() ; ++i ) {
+        StringPiece str = input.Get(i,NULL);
+        output->push_back( str_pool_.Intern( str.data , str.size ) );
+    }
+}
+
+#if TSUB_HAS_THREADS
+unsigned int TextProcessor::WorkerSize( const Options& options ,
+    std::size_t size ) const {
+    // Size is 0 if the product overflows , leave it to the sequential path
+    if( size == 0 || size < options.parallel_threshold )
+        return 1;
+
+    unsigned int workers = options.threads;
+    if( workers == 0 )
+        workers = std::thread::hardware_concurrency();
+    if( workers == 0 )
+        return 1;
+    if( workers > size )
+        workers = static_cast<unsigned int>(size);
+    return workers;
+}
+
+void TextProcessor::ParallelGenerate( std::vector<std::string>* output ,
+    std::size_t size ,
+    unsigned int workers ) {
+
+    // Each worker owns a disjoint range of the output , so the order is the
+    // same as the sequential one
+    output->resize(size);
+
+    ParallelFor( workers , size ,
+        [this,output]( unsigned int , std::size_t begin , std::size_t end ) {
+            Odometer odometer(segment_list_,begin);
+            for( std::size_t i = begin ; i < end ; ++i , odometer.Next() ) {
+                std::string& str = (*output)[i];
+                str.reserve( odometer.Length() );
+                odometer.Append( &str );
+            }
+        });
+}
+
+void TextProcessor::ParallelGenerate( OutputBuffer* output ,
+    std::size_t size ,
+    unsigned int workers ) {
+
+    const std::size_t separator = output->has_separator_ ? 1 : 0;
+    std::vector<std::size_t>& offset = output->offset_;
+    std::vector<std::size_t> chunk(workers+1,0);
+
+    // 1. Each worker records the length of its strings and the size of its
+    //    chunk
+    offset.resize(size+1);
+    ParallelFor( workers , size ,
+        [&]( unsigned int worker , std::size_t begin , std::size_t end ) {
+            std::size_t bytes = 0;
+            Odometer odometer(segment_list_,begin);
+            for( std::size_t i = begin ; i < end ; ++i , odometer.Next() ) {
+                offset[i+1] = odometer.Length() + separator;
+                bytes += offset[i+1];
+            }
+            chunk[worker+1] = bytes;
+        });
+
+    // 2. Where each chunk starts inside of the buffer
+    for( unsigned int i = 0 ; i < workers ; ++i )
+        chunk[i+1] += chunk[i];
+    output->data_.resize( chunk[workers] );
+
+    // 3. Each worker copies its strings to its own part of the buffer
+    char* buffer = &(output->data_[0]);
+    const char sep = output->separator_;
+    ParallelFor( workers , size ,
+        [&]( unsigned int worker , std::size_t begin , std::size_t end ) {
+            std::size_t pos = chunk[worker];
+            Odometer odometer(segment_list_,begin);
+            for( std::size_t i = begin ; i < end ; ++i , odometer.Next() ) {
+                char* next = odometer.Copy( buffer + pos );
+                if( separator )
+                    *next = sep;
+                pos += offset[i+1];
+                offset[i+1] = pos;
+            }
+        });
+}
+#endif // TSUB_HAS_THREADS
+
+bool TextProcessor::Run( std::vector<std::string>* output ,
+    const Options& options ) {
+    output->clear();
+
+    if( !Evaluate() )
+        return false;
+
+    std::size_t size = ResultSize();
+
+#if TSUB_HAS_THREADS
+    unsigned int workers = WorkerSize(options,size);
+    if( workers > 1 ) {
+        ParallelGenerate( output , size , workers );
+        return true;
+    }
+#else
+    (void)options;
+#endif // TSUB_HAS_THREADS
+
+    VectorSink sink(output);
+    output->reserve( size );
+    GenerateResult( &sink );
+    return true;
+}
+
+bool TextProcessor::Run( OutputBuffer* output , const Options& options ) {
+    output->Clear();
+
+    if( !Evaluate() )
+        return false;
+
+    std::size_t size = ResultSize();
+
+#if TSUB_HAS_THREADS
+    unsigned int workers = WorkerSize(options,size);
+    if( workers > 1 ) {
+        ParallelGenerate( output , size , workers );
+        return true;
+    }
+#else
+    (void)options;
+#endif // TSUB_HAS_THREADS
+
+    output->offset_.reserve( size + 1 );
+    output->data_.reserve( ResultBytes( output->has_separator_ ? 1 : 0 ) );
+    GenerateResult( output );
+    return true;
+}
+
+bool TextProcessor::Run( Sink* sink ) {
+    if( !Evaluate() )
+        return false;
+
+    GenerateResult( sink );
+    return true;
+}
+
+bool TextProcessor::Run( ExpansionImpl* output ) {
+    if( !Evaluate() )
+        return false;
+
+    // The string pieces point into the pool , both are handed over
+    output->segment_list_.swap( segment_list_ );
+    output->str_pool_.Swap( &str_pool_ );
+    return true;
+}
+
+bool TextProcessor::Update( ExpansionImpl* output , const std::vector<bool>& changed ) {
+    const std::vector<TemplateImpl::Segment>& segments = tmpl_->segments();
+    const std::vector<StrList>& previous = output->segment_list_;
+
+    // The new lists are built aside , so the expansion is kept as it was
+    // if the evaluation fails
+    segment_list_.resize( segments.size() );
+
+    for( std::size_t i = 0 ; i < segments.size() ; ++i ) {
+        const TemplateImpl::Segment& segment = segments[i];
+
+        if( segment.exp == NULL || IsShared(segment) || DependsOn(segment,changed) ) {
+            if( !EvaluateSegment(i) )
+                return false;
+        } else {
+            // Not affected , the old strings are moved into the new pool
+            CopyStringList( previous[i] , &segment_list_[i] );
+        }
+    }
+
+    output->segment_list_.swap( segment_list_ );
+    output->str_pool_.Swap( &str_pool_ );
+    return true;
+}
+
+Expansion::Expansion():
+    impl_(NULL)
+    {}
+
+Expansion::~Expansion() {
+    delete impl_;
+}
+
+bool Expansion::Count( std::size_t* count ) const {
+    if( impl_ == NULL ) {
+        *count = 0;
+        return true;
+    }
+    return ProductSize( impl_->segment_list() , count );
+}
+
+bool Expansion::At( std::size_t index , std::string* output ) const {
+    if( impl_ == NULL )
+        return false;
+
+    Odometer odometer( impl_->segment_list() , index );
+    if( odometer.done() )
+        return false;
+
+    output->clear();
+    output->reserve( odometer.Length() );
+    odometer.Append( output );
+    return true;
+}
+
+void Expansion::Range( std::size_t begin , std::size_t end , Sink* sink ) const {
+    if( impl_ == NULL )
+        return;
+
+    std::string buffer;
+    Odometer odometer( impl_->segment_list() , begin );
+
+    for( std::size_t i = begin ; i < end && !odometer.done() ; ++i , odometer.Next() ) {
+        buffer.clear();
+        buffer.reserve( odometer.Length() );
+        odometer.Append( &buffer );
+        if( !sink->Emit(buffer) )
+            return;
+    }
+}
+
+namespace {
+
+// Byte order of the string pieces , so they could be kept in a set
+struct PieceLess {
+    bool operator () ( const StringPiece& l , const StringPiece& r ) const {
+        std::size_t size = std::min(l.size,r.size);
+        int ret = size == 0 ? 0 : std::memcmp(l.data,r.data,size);
+        return ret != 0 ? ret < 0 : l.size < r.size;
+    }
+};
+
+typedef std::set<StringPiece,PieceLess> PieceSet;
+
+// Collect the distinct strings of the list in order , the numbers of a range
+// are rendered into the pool since they have no storage of their own
+void DistinctStrings( const StrList& list , StringPool* pool ,
+                      PieceSet* seen , StrList* output ) {
+    char buffer[kMaxNumberLength];
+    for( std::size_t i = 0 ; i < list.size() ; ++i ) {
+        StringPiece str = list.Get(i,buffer);
+        if( list.IsRange() )
+            str = pool->Store(str);
+        if( seen->insert(str).second && output != NULL )
+            output->push_back(str);
+    }
+}
+
+// Pass the outputs of from that to does not generate to the sink. An output
+// of from is missing in to once the string of one segment is missing in the
+// list of that segment , so the missing outputs are split by the first such
+// segment j : the segments before j take the strings both lists have , the
+// segment j takes its missing strings and the segments after j take all of
+// their strings. The parts are disjoint and only a segment that lost some
+// strings starts a part , so the unchanged outputs are never generated.
+void EmitDifference( const std::vector<StrList>& from ,
+                     const std::vector<StrList>& to ,
+                     Sink* sink ) {
+    const std::size_t size = from.size();
+    StringPool pool;
+    std::vector<StrList> all(size);
+    std::vector<StrList> kept(size);
+    std::vector<StrList> missing(size);
+    bool changed = false;
+
+    for( std::size_t i = 0 ; i < size ; ++i ) {
+        PieceSet seen , other;
+        DistinctStrings( from[i] , &pool , &seen , &all[i] );
+        DistinctStrings( to[i] , &pool , &other , NULL );
+
+        for( std::size_t j = 0 ; j < all[i].size() ; ++j ) {
+            StringPiece str = all[i].Get(j,NULL);
+            if( other.find(str) != other.end() ) {
+                kept[i].push_back(str);
+            } else {
+                missing[i].push_back(str);
+                changed = true;
+            }
+        }
+    }
+
+    if( !changed )
+        return;
+
+    std::vector<StrList> part(size);
+    std::string buffer;
+
+    for( std::size_t j = 0 ; j < size ; ++j ) {
+        if( missing[j].empty() )
+            continue;
+
+        for( std::size_t i = 0 ; i < size ; ++i )
+            part[i] = i < j ? kept[i] : ( i == j ? missing[i] : all[i] );
+
+        for( Odometer odometer(part) ; !odometer.done() ; odometer.Next() ) {
+            buffer.clear();
+            buffer.reserve( odometer.Length() );
+            odometer.Append( &buffer );
+            if( !sink->Emit(buffer) )
+                return;
+        }
+    }
+}
+
+}// namespace
+
+bool Expansion::Diff( const Expansion& previous , Sink* added , Sink* removed ) const {
+    if( impl_ == NULL || previous.impl_ == NULL ||
+        impl_->tmpl().impl_ != previous.impl_->tmpl().impl_ )
+        return false;
+
+    if( removed != NULL )
+        EmitDifference( previous.impl_->segment_list() , impl_->segment_list() , removed );
+    if( added != NULL )
+        EmitDifference( impl_->segment_list() , previous.impl_->segment_list() , added );
+    return true;
+}
+
+void Expansion::Swap( Expansion* other ) {
+    std::swap( impl_ , other->impl_ );
+}
+
+// Context that remembers the variables of the underlying context and the
+// results of its pure functions , each variable is looked up only once and
+// each pure function is called once per argument list while the cache lives.
+class MemoContext : public Context {
 public:
+    explicit MemoContext( Context* context ):
+        context_(context)
+        {}
 
     virtual bool GetVariable( const std::string& var , Value* val ) {
-        assert(var == "abcd");
-        val->SetNumber(5);
+        std::map<std::string,Value>::iterator ib = var_.find(var);
+        if( ib != var_.end() ) {
+            *val = ib->second;
+            return true;
+        }
+
+        if( !context_->GetVariable(var,val) )
+            return false;
+        var_.insert( std::make_pair(var,*val) );
         return true;
     }
 
-    virtual bool ExecFunction( const std::string& func_name ,
+    virtual bool ExecFunction( const std::string& name ,
                                const std::vector<Value>& par ,
                                Value* ret ,
                                std::string* error ) {
-        assert( func_name == "func" );
-        ret->SetNumber( par[0].GetNumber() + 1 );
+        if( !IsPure(name) )
+            return context_->ExecFunction(name,par,ret,error);
+
+        std::string key(name);
+        key.push_back('(');
+        return Call(&key,par,ret) ||
+               Save(key,context_->ExecFunction(name,par,ret,error),*ret);
+    }
+
+    virtual bool IsPure( const std::string& name ) {
+        std::map<std::string,bool>::iterator ib = pure_.find(name);
+        if( ib != pure_.end() )
+            return ib->second;
+
+        bool pure = context_->IsPure(name);
+        pure_.insert( std::make_pair(name,pure) );
+        return pure;
+    }
+
+    virtual SymbolId Resolve( const std::string& name ) {
+        std::map<std::string,SymbolId>::iterator ib = symbol_.find(name);
+        if( ib != symbol_.end() )
+            return ib->second;
+
+        SymbolId id = context_->Resolve(name);
+        symbol_.insert( std::make_pair(name,id) );
+        if( id != NO_SYMBOL && IsPure(name) )
+            pure_id_.insert(id);
+        return id;
+    }
+
+    virtual bool GetVariableById( SymbolId id , Value* val ) {
+        std::map<SymbolId,Value>::iterator ib = var_by_id_.find(id);
+        if( ib != var_by_id_.end() ) {
+            *val = ib->second;
+            return true;
+        }
+
+        if( !context_->GetVariableById(id,val) )
+            return false;
+        var_by_id_.insert( std::make_pair(id,*val) );
+        return true;
+    }
+
+    virtual bool ExecFunctionById( SymbolId id ,
+                                   const std::vector<Value>& par ,
+                                   Value* ret ,
+                                   std::string* error ) {
+        if( pure_id_.find(id) == pure_id_.end() )
+            return context_->ExecFunctionById(id,par,ret,error);
+
+        // Id never collides with a name , which can't start with #
+        char buffer[32];
+        sprintf(buffer,"#%d(",static_cast<int>(id));
+        std::string key(buffer);
+        return Call(&key,par,ret) ||
+               Save(key,context_->ExecFunctionById(id,par,ret,error),*ret);
+    }
+
+private:
+    // Append the arguments to the key and look it up
+    bool Call( std::string* key , const std::vector<Value>& par , Value* ret ) {
+        for( std::size_t i = 0 ; i < par.size() ; ++i )
+            AppendKey(par[i],key);
+
+        std::map<std::string,Value>::iterator ib = call_.find(*key);
+        if( ib == call_.end() )
+            return false;
+        *ret = ib->second;
         return true;
     }
 
+    // Remember the result of a successful call
+    bool Save( const std::string& key , bool success , const Value& ret ) {
+        if( success )
+            call_.insert( std::make_pair(key,ret) );
+        return success;
+    }
+
+    static void AppendKey( const Value& val , std::string* key );
+
+private:
+    Context* context_;
+    std::map<std::string,Value> var_;
+    std::map<std::string,SymbolId> symbol_;
+    std::map<SymbolId,Value> var_by_id_;
+
+    // Pure functions and their results keyed by name and arguments
+    std::map<std::string,bool> pure_;
+    std::set<SymbolId> pure_id_;
+    std::map<std::string,Value> call_;
 };
 
-void TestInterp() {
-    std::string txt = "[1..3]{$+10}";
-    std::string err;
-    int cur_pos;
-    Value ret;
-    TestContext context;
+void MemoContext::AppendKey( const Value& val , std::string* key ) {
+    // Each value is tagged by its type and strings are prefixed by their
+    // length , so different argument lists never have the same key
+    char buffer[64];
 
-    Interp interp(
-        txt,
-        0,
-        &context,
-        &err);
+    switch( val.type() ) {
+        case Value::VALUE_STRING:
+            sprintf(buffer,"s%d:",static_cast<int>(val.GetString().size()));
+            key->append(buffer);
+            key->append(val.GetString());
+            return;
+        case Value::VALUE_NUMBER:
+            key->push_back('n');
+            AppendNumber(val.GetNumber(),key);
+            key->push_back(';');
+            return;
+        case Value::VALUE_LIST: {
+            const ValueList& l = val.GetList();
+            if( l.IsRange() ) {
+                key->push_back('r');
+                AppendNumber(l.range_start(),key);
+                key->push_back(',');
+                AppendNumber(l.range_step(),key);
+                sprintf(buffer,",%d;",static_cast<int>(l.size()));
+                key->append(buffer);
+                return;
+            }
+            sprintf(buffer,"l%d:",static_cast<int>(l.size()));
+            key->append(buffer);
+            for( std::size_t i = 0 ; i < l.size() ; ++i )
+                AppendKey(l.Element(i),key);
+            return;
+        }
+        default:
+            key->push_back('z');
+            return;
+    }
+}
 
-    assert( interp.DoInterp(&ret,&cur_pos) );
-    std::cout<<txt.substr(cur_pos)<<std::endl;
-    std::cout<<ret.GetList().Index(1).GetNumber()<<std::endl;
+namespace {
+
+// The context used for the expansion , it is wrapped by the memo context if
+// memoization is requested
+Context* MemoizeContext( Context* context , MemoContext* memo , const Options& options ) {
+    return options.memoize && context != NULL ? memo : context;
 }
-#endif // NDEBUG
 
-}// namespace exp
-}// namespace
+}// namespace
+
+Template::Template():
+    impl_(NULL)
+    {}
+
+Template::Template( const Template& tmpl ):
+    impl_(tmpl.impl_) {
+        if( impl_ != NULL )
+            impl_->Retain();
+    }
+
+Template& Template::operator = ( const Template& tmpl ) {
+    if( tmpl.impl_ != NULL )
+        tmpl.impl_->Retain();
+    if( impl_ != NULL )
+        impl_->Release();
+    impl_ = tmpl.impl_;
+    return *this;
+}
+
+Template::~Template() {
+    if( impl_ != NULL )
+        impl_->Release();
+}
+
+bool Template::Expand( Context* context ,
+    std::vector<std::string>* output ,
+    std::string* error_desp ,
+    const Options& options ) const {
+
+    if( impl_ == NULL ) {
+        error_desp->assign("[Module:Template]:Template is not compiled");
+        return false;
+    }
+
+    MemoContext memo(context);
+    TextProcessor processor(
+        *impl_,MemoizeContext(context,&memo,options),error_desp);
+
+    return processor.Run( output , options );
+}
+
+bool Template::Expand( Context* context ,
+    OutputBuffer* output ,
+    std::string* error_desp ,
+    const Options& options ) const {
+
+    if( impl_ == NULL ) {
+        error_desp->assign("[Module:Template]:Template is not compiled");
+        return false;
+    }
+
+    MemoContext memo(context);
+    TextProcessor processor(
+        *impl_,MemoizeContext(context,&memo,options),error_desp);
+
+    return processor.Run( output , options );
+}
+
+bool Template::Expand( Context* context ,
+    Sink* sink ,
+    std::string* error_desp ,
+    const Options& options ) const {
+
+    if( impl_ == NULL ) {
+        error_desp->assign("[Module:Template]:Template is not compiled");
+        return false;
+    }
+
+    MemoContext memo(context);
+    TextProcessor processor(
+        *impl_,MemoizeContext(context,&memo,options),error_desp);
+
+    return processor.Run( sink );
+}
+
+bool Template::Evaluate( Context* context ,
+    Expansion* output ,
+    std::string* error_desp ) const {
+
+    if( impl_ == NULL ) {
+        error_desp->assign("[Module:Template]:Template is not compiled");
+        return false;
+    }
+
+    TextProcessor processor(
+        *impl_,context,error_desp);
+
+    ExpansionImpl* result = new ExpansionImpl(*this);
+    if( !processor.Run( result ) ) {
+        delete result;
+        return false;
+    }
+
+    delete output->impl_;
+    output->impl_ = result;
+    return true;
+}
+
+bool Template::Update( Context* context ,
+    const std::vector<std::string>& changed ,
+    Expansion* output ,
+    std::string* error_desp ) const {
+
+    if( impl_ == NULL ) {
+        error_desp->assign("[Module:Template]:Template is not compiled");
+        return false;
+    }
+
+    // An expansion of another template is evaluated from scratch
+    if( output->impl_ == NULL || output->impl_->tmpl().impl_ != impl_ )
+        return Evaluate(context,output,error_desp);
+
+    const exp::SymbolTable& table = impl_->symbol_table();
+    std::vector<bool> symbol( table.size() , false );
+    for( std::size_t i = 0 ; i < changed.size() ; ++i ) {
+        int index = table.Find(changed[i]);
+        if( index >= 0 )
+            symbol[index] = true;
+    }
+
+    TextProcessor processor(
+        *impl_,context,error_desp);
+
+    return processor.Update( output->impl_ , symbol );
+}
+
+bool Template::Count( Context* context ,
+    std::size_t* count ,
+    std::string* error_desp ) const {
+
+    Expansion expansion;
+    if( !Evaluate(context,&expansion,error_desp) )
+        return false;
+
+    if( !expansion.Count(count) ) {
+        error_desp->assign("[Module:Template]:Number of outputs is out of range");
+        return false;
+    }
+    return true;
+}
+
+bool Template::At( Context* context ,
+    std::size_t index ,
+    std::string* output ,
+    std::string* error_desp ) const {
+
+    Expansion expansion;
+    if( !Evaluate(context,&expansion,error_desp) )
+        return false;
+
+    if( !expansion.At(index,output) ) {
+        error_desp->assign("[Module:Template]:Output index is out of range");
+        return false;
+    }
+    return true;
+}
+
+bool Template::Range( Context* context ,
+    std::size_t begin ,
+    std::size_t end ,
+    Sink* sink ,
+    std::string* error_desp ) const {
+
+    Expansion expansion;
+    if( !Evaluate(context,&expansion,error_desp) )
+        return false;
+
+    expansion.Range(begin,end,sink);
+    return true;
+}
+
+bool Compile( const std::string& input ,
+    Template* output ,
+    std::string* error_desp ) {
+
+    TemplateImpl* impl = new TemplateImpl(input);
+    TextCompiler compiler( impl , error_desp );
+
+    if( !compiler.Run() ) {
+        impl->Release();
+        return false;
+    }
+
+    if( output->impl_ != NULL )
+        output->impl_->Release();
+    output->impl_ = impl;
+    return true;
+}
+
+namespace {
+
+// Hash of the template text. It reads a word at a time , so a large
+// template is hashed much faster than it is compared or compiled.
+std::size_t HashText( const char* data , std::size_t size ) {
+    static const std::size_t kMul = sizeof(std::size_t) == 8 ?
+        ( static_cast<std::size_t>(0x9E3779B9U) << 16 << 16 ) | 0x7F4A7C15U :
+        static_cast<std::size_t>(0x9E3779B1U);
+    const std::size_t kShift = sizeof(std::size_t) * 4;
+    std::size_t hash = size * kMul;
+    std::size_t word;
+
+    for( ; size >= sizeof(word) ; data += sizeof(word) , size -= sizeof(word) ) {
+        std::memcpy(&word,data,sizeof(word));
+        hash = ( hash ^ word ) * kMul;
+        hash ^= hash >> kShift;
+    }
+
+    word = 0;
+    std::memcpy(&word,data,size);
+    hash = ( hash ^ word ) * kMul;
+    return hash ^ ( hash >> kShift );
+}
+
+// Lock of a cache shard , nothing to lock without the thread support
+class CacheMutex {
+public:
+#if TSUB_HAS_THREADS
+    void Lock() {
+        mutex_.lock();
+    }
+
+    void Unlock() {
+        mutex_.unlock();
+    }
+
+private:
+    std::mutex mutex_;
+#else
+    void Lock() {}
+    void Unlock() {}
+#endif // TSUB_HAS_THREADS
+};
+
+class ScopedLock {
+public:
+    explicit ScopedLock( CacheMutex* mutex ):
+        mutex_(mutex) {
+            mutex_->Lock();
+        }
+
+    ~ScopedLock() {
+        mutex_->Unlock();
+    }
+
+private:
+    CacheMutex* mutex_;
+
+    ScopedLock( const ScopedLock& );
+    ScopedLock& operator = ( const ScopedLock& );
+};
+
+// Templates of one shard in LRU order , the most recently used one comes
+// first. The index maps the hash of the text to the entries.
+struct CacheShard {
+    struct Entry {
+        std::string input;
+        std::size_t hash;
+        std::size_t bytes;
+        Template tmpl;
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef std::multimap<std::size_t,EntryList::iterator> EntryIndex;
+
+    CacheMutex mutex;
+    EntryList lru;
+    EntryIndex index;
+    std::size_t bytes;
+    TemplateCache::Stats stats;
+
+    CacheShard():
+        bytes(0)
+        {}
+
+    // Find the entry and move it to the front
+    bool Touch( std::size_t hash , const std::string& input , Template* output ) {
+        std::pair<EntryIndex::iterator,EntryIndex::iterator> range =
+            index.equal_range(hash);
+        for( ; range.first != range.second ; ++range.first ) {
+            EntryList::iterator entry = range.first->second;
+            if( entry->input == input ) {
+                lru.splice( lru.begin() , lru , entry );
+                *output = entry->tmpl;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Drop the least recently used entries until the shard fits
+    void Evict( std::size_t capacity ) {
+        while( bytes > capacity ) {
+            EntryList::iterator entry = --lru.end();
+            std::pair<EntryIndex::iterator,EntryIndex::iterator> range =
+                index.equal_range(entry->hash);
+            for( ; range.first != range.second ; ++range.first ) {
+                if( range.first->second == entry ) {
+                    index.erase(range.first);
+                    break;
+                }
+            }
+            bytes -= entry->bytes;
+            ++stats.evictions;
+            lru.erase(entry);
+        }
+    }
+};
+
+}// namespace
+
+class TemplateCacheImpl {
+public:
+    TemplateCacheImpl( std::size_t capacity , unsigned int shards ):
+        shard_( shards == 0 ? 1 : shards ),
+        capacity_( capacity / shard_.size() )
+        {}
+
+    CacheShard* shard( std::size_t index ) {
+        return &shard_[index];
+    }
+
+    std::size_t shard_size() const {
+        return shard_.size();
+    }
+
+    std::size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    std::vector<CacheShard> shard_;
+    std::size_t capacity_;
+};
+
+TemplateCache::TemplateCache( std::size_t capacity , unsigned int shards ):
+    impl_( new TemplateCacheImpl(capacity,shards) )
+    {}
+
+TemplateCache::~TemplateCache() {
+    delete impl_;
+}
+
+bool TemplateCache::Get( const std::string& input ,
+    Template* output ,
+    std::string* error_desp ) {
+
+    std::size_t hash = HashText( input.data() , input.size() );
+    CacheShard* shard = impl_->shard( hash % impl_->shard_size() );
+
+    {
+        ScopedLock lock( &(shard->mutex) );
+        if( shard->Touch(hash,input,output) ) {
+            ++shard->stats.hits;
+            return true;
+        }
+        ++shard->stats.misses;
+    }
+
+    // Compile without the lock , so the shard is not blocked meanwhile
+    Template tmpl;
+    if( !Compile(input,&tmpl,error_desp) )
+        return false;
+
+    ScopedLock lock( &(shard->mutex) );
 
-namespace tsub {
+    // Another thread may have compiled the same text
+    if( shard->Touch(hash,input,output) )
+        return true;
 
-using exp::Interp;
+    std::size_t bytes = sizeof(CacheShard::Entry) + input.size() +
+        tmpl.impl_->MemoryUsage();
+    if( bytes <= impl_->capacity() ) {
+        shard->lru.push_front( CacheShard::Entry() );
+        CacheShard::Entry& entry = shard->lru.front();
+        entry.input = input;
+        entry.hash = hash;
+        entry.bytes = bytes;
+        entry.tmpl = tmpl;
+        shard->index.insert( std::make_pair( hash , shard->lru.begin() ) );
+        shard->bytes += bytes;
+        shard->Evict( impl_->capacity() );
+    }
 
-ValueList* Value::CopyList( const ValueList& l ) {
-    ValueList* ret = new ValueList();
+    *output = tmpl;
+    return true;
+}
 
-    for( std::size_t i = 0 ; i < l.size() ; ++i ) {
-        const Value& value = l.Index( static_cast<int>(i) );
-        ret->AddValue(value);
+TemplateCache::Stats TemplateCache::GetStats() const {
+    Stats stats;
+    for( std::size_t i = 0 ; i < impl_->shard_size() ; ++i ) {
+        CacheShard* shard = impl_->shard(i);
+        ScopedLock lock( &(shard->mutex) );
+        stats.hits += shard->stats.hits;
+        stats.misses += shard->stats.misses;
+        stats.evictions += shard->stats.evictions;
+        stats.entries += shard->lru.size();
+        stats.bytes += shard->bytes;
     }
+    return stats;
+}
 
-    return ret;
+void TemplateCache::Clear() {
+    for( std::size_t i = 0 ; i < impl_->shard_size() ; ++i ) {
+        CacheShard* shard = impl_->shard(i);
+        ScopedLock lock( &(shard->mutex) );
+        shard->index.clear();
+        shard->lru.clear();
+        shard->bytes = 0;
+    }
 }
 
-class TextProcessor {
-private:
-    // Manipulate each string as reference inside of the string pool
-    typedef std::vector< const std::string* > StrRep;
+namespace {
 
-public:
-    TextProcessor( const std::string& input , Context* context , std::string* error_desp ):
-        input_(&input),
-        context_(context),
-        error_desp_(error_desp),
-        position_(0)
-        {}
+// Compile the input of Run , through the cache if there is one
+bool CompileInput( const std::string& input ,
+    Template* output ,
+    std::string* error_desp ,
+    const Options& options ) {
+    if( options.cache != NULL )
+        return options.cache->Get(input,output,error_desp);
+    return Compile(input,output,error_desp);
+}
 
-    bool Run( std::vector<std::string>* output );
+}// namespace
 
-private:
-    bool ProcessExp( Value* val );
-    void Expand( const std::string* str );
-    void Concatenate( const std::vector<const std::string*>& slist );
-    void GenerateResult( std::vector<std::string>* output );
-    void JoinString( const StrRep& rep , std::string* output );
-    void ReportError( const char* format , ... );
+bool RunBatch( Context* context ,
+    const std::vector<Template>& templates ,
+    std::vector< std::vector<std::string> >* outputs ,
+    std::string* error_desp ,
+    const Options& options ) {
 
-    void ValueToStringList( const Value& val , std::vector<const std::string*>* output );
-    const std::string* NumberToString( int num );
+    char prefix[64];
 
-private:
-    const std::string* GetString( const std::string& str ) const {
-        std::set<std::string>::iterator ib = str_pool_.find(str);
-        if( ib == str_pool_.end() ) {
-            // Do real insertion here
-            std::pair<
-                std::set<std::string>::iterator,
-                bool > ret = str_pool_.insert(str);
-            assert( ret.second );
-            return &(*ret.first);
-        } else {
-            return &(*ib);
+    outputs->resize( templates.size() );
+
+    for( std::size_t i = 0 ; i < templates.size() ; ++i ) {
+        if( templates[i].impl_ == NULL ) {
+            sprintf(prefix,"%d",static_cast<int>(i));
+            error_desp->assign("[Module:Batch,Index:");
+            error_desp->append(prefix);
+            error_desp->append("]:Template is not compiled");
+            return false;
         }
     }
 
-    bool IsEscapeChar( int cha ) {
-        switch(cha) {
-            case '\\':
-            case '`' :
-                return true;
-            default:
-                return false;
+    if( templates.empty() )
+        return true;
+
+    MemoContext memo(context);
+    std::string error;
+    TextProcessor processor( *templates[0].impl_ ,
+                             context == NULL ? NULL : &memo ,
+                             &error );
+
+    for( std::size_t i = 0 ; i < templates.size() ; ++i ) {
+        if( i != 0 )
+            processor.Reset( *templates[i].impl_ );
+
+        if( !processor.Run( &(*outputs)[i] , options ) ) {
+            sprintf(prefix,"[Module:Batch,Index:%d]:\n",static_cast<int>(i));
+            error_desp->assign(prefix);
+            error_desp->append(error);
+            return false;
         }
     }
+    return true;
+}
 
-private:
-    // Intermediate representation of each result set
-    std::vector<StrRep> result_set_;
+bool RunBatch( Context* context ,
+    const std::vector<std::string>& inputs ,
+    std::vector< std::vector<std::string> >* outputs ,
+    std::string* error_desp ,
+    const Options& options ) {
 
-    // Real string pool
-    mutable std::set<std::string> str_pool_;
+    std::vector<Template> templates( inputs.size() );
+    std::string error;
+    char prefix[64];
 
-    // Input string pointer
-    const std::string* input_;
+    // The same text is compiled only once per batch , all of its inputs
+    // share the compiled program
+    std::map<std::string,std::size_t> compiled;
 
-    // Context
-    Context* context_;
+    for( std::size_t i = 0 ; i < inputs.size() ; ++i ) {
+        std::map<std::string,std::size_t>::iterator ib = compiled.find(inputs[i]);
+        if( ib != compiled.end() ) {
+            templates[i] = templates[ib->second];
+            continue;
+        }
+        compiled.insert( std::make_pair( inputs[i] , i ) );
 
-    // Error
-    std::string* error_desp_;
+        if( !CompileInput(inputs[i],&templates[i],&error,options) ) {
+            sprintf(prefix,"[Module:Batch,Index:%d]:\n",static_cast<int>(i));
+            error_desp->assign(prefix);
+            error_desp->append(error);
+            return false;
+        }
+    }
 
-    // Position
-    std::string::size_type position_;
-};
+    return RunBatch(context,templates,outputs,error_desp,options);
+}
 
-void TextProcessor::ReportError( const char* format , ... ) {
-    char msg[1024];
-    va_list vlist;
-    std::stringstream formatter;
+// Main text processing part
+// The special character ` is used to encapsulate the small expression
+// for execution. After execution, the output value will be converted
+// into the value set and concatenate with the existed text segment .
 
-    va_start(vlist,format);
-    vsprintf(msg,format,vlist);
+bool Run( Context* context ,
+    const std::string& input ,
+    std::vector<std::string>* output,
+    std::string* error_desp ,
+    const Options& options ) {
 
-    formatter<<"[Module:TextProcessor]:"<<msg;
-    *error_desp_ = formatter.str();
-}
+    Template tmpl;
 
-const std::string* TextProcessor::NumberToString( int num ) {
-    char buf[256];
-    sprintf(buf,"%d",num);
-    return GetString(std::string(buf));
-}
+    if( !CompileInput(input,&tmpl,error_desp,options) )
+        return false;
 
-void TextProcessor::ValueToStringList( const Value& val , std::vector<const std::string*>* output ) {
-    switch(val.type()) {
-        case Value::VALUE_STRING:
-            output->push_back( GetString(val.GetString()) );
-            return;
-        case Value::VALUE_NUMBER:
-            output->push_back( NumberToString(val.GetNumber()) );
-            return;
-        case Value::VALUE_LIST: {
-            const ValueList& vl = val.GetList();
-            output->reserve( output->size() + vl.size() );
-            for( std::size_t i = 0 ; i < vl.size() ; ++i ) {
-                const Value& v = vl.Index(i);
-                ValueToStringList(v,output);
-            }
-            return;
-        }
-        default:
-            UNREACHABLE(return);
-    }
+    return tmpl.Expand( context, output, error_desp, options );
 }
 
-void TextProcessor::Expand( const std::string* str ) {
-    if( result_set_.empty() ) {
-        result_set_.push_back(StrRep());
-        result_set_.back().push_back(str);
-    } else {
-        for( std::vector<StrRep>::iterator ib = result_set_.begin() ;
-             ib != result_set_.end() ; ++ib ) {
-             (*ib).push_back(str);
-        }
-    }
-}
+bool Run( Context* context ,
+    const std::string& input ,
+    OutputBuffer* output ,
+    std::string* error_desp ,
+    const Options& options ) {
 
-void TextProcessor::Concatenate( const std::vector<const std::string*>& slist ) {
-    if( result_set_.empty() ) {
-        result_set_.reserve( result_set_.size() + slist.size() );
-        // The result set is empty, just copy
-        for( std::size_t i = 0 ; i < slist.size() ; ++i ) {
-            result_set_.push_back(StrRep());
-            result_set_.back().push_back( slist[i] );
-        }
-    } else {
-        // We need to concatenation which will result in set has size:
-        // size(slist) * size(result_set_)
-        std::vector<StrRep> temp;
-        temp.reserve( result_set_.size()*slist.size() );
-
-        for( std::size_t i = 0 ; i < slist.size() ; ++i ) {
-            for ( std::vector<StrRep>::iterator ib = result_set_.begin() ;
-                  ib != result_set_.end() ; ++ib ) {
-                // Constructing a StrRep that is the copy of the element of result_set
-                temp.push_back(StrRep(*ib));
-                // Push back the new string representation
-                temp.back().push_back(slist[i]);
-            }
-        }
+    Template tmpl;
 
-        result_set_.swap(temp);
-    }
+    if( !CompileInput(input,&tmpl,error_desp,options) )
+        return false;
+
+    return tmpl.Expand( context, output, error_desp, options );
 }
 
-void TextProcessor::JoinString( const StrRep& rep , std::string* output ) {
-    std::size_t cap=0;
-    assert( !rep.empty() );
+bool Run( Context* context ,
+    const std::string& input ,
+    Sink* sink ,
+    std::string* error_desp ,
+    const Options& options ) {
 
-    for( StrRep::const_iterator ib = rep.begin() ; ib != rep.end() ; ++ib ) {
-        cap += (*ib)->size();
-    }
-    output->clear();
-    output->reserve(cap);
+    Template tmpl;
 
-    for( StrRep::const_iterator ib = rep.begin() ; ib != rep.end() ; ++ib ) {
-        output->append( *(*ib) );
-    }
+    if( !CompileInput(input,&tmpl,error_desp,options) )
+        return false;
+
+    return tmpl.Expand( context, sink, error_desp, options );
 }
 
+}// namespace tsub
 
-void TextProcessor::GenerateResult( std::vector<std::string>* output ) {
-    output->clear();
-    output->reserve( result_set_.size() );
+#ifndef NDEBUG
+class CountSink : public tsub::Sink {
+public:
+    explicit CountSink( std::size_t limit ):
+        count(0),
+        limit_(limit)
+        {}
 
-    for( std::vector<StrRep>::iterator ib = result_set_.begin() ;
-         ib != result_set_.end() ; ++ib ) {
-        // For each result set you need to do concatenation
-        output->push_back(std::string());
-        JoinString( *ib , &(output->back()) );
+    virtual bool Emit( const std::string& str ) {
+        last = str;
+        return ++count < limit_;
     }
-}
 
+    std::size_t count;
+    std::string last;
 
-bool TextProcessor::ProcessExp( Value* val ) {
-    int new_pos;
+private:
+    std::size_t limit_;
+};
 
-    exp::Interp interp( *input_ ,
-        static_cast<int>(position_) ,
-        context_ ,
-        error_desp_ );
+// Context that counts the calls , twice is pure and tick is not
+class MemoCountContext : public tsub::Context {
+public:
+    MemoCountContext():
+        variable(0),
+        twice(0),
+        tick(0)
+        {}
 
-    // Now interpreting the script from current position
-    if( !interp.DoInterp(val,&new_pos) ) {
-        return false;
+    virtual bool GetVariable( const std::string& name , tsub::Value* val ) {
+        if( name != "host" )
+            return false;
+        ++variable;
+        val->SetString("h");
+        return true;
     }
 
-    if( input_->at(new_pos) != '`' ) {
-        ReportError("The expression needs to be ended with \"`\"");
+    virtual bool ExecFunction( const std::string& name ,
+                               const std::vector<tsub::Value>& par ,
+                               tsub::Value* ret ,
+                               std::string* ) {
+        if( name == "twice" ) {
+            ++twice;
+            ret->SetNumber( par[0].GetNumber() * 2 );
+            return true;
+        } else if( name == "tick" ) {
+            ret->SetNumber( ++tick );
+            return true;
+        }
         return false;
     }
 
-    // We don't need to move this cursor, since in the mainloop the ` will
-    // be skipped by the main loop counter
-    position_ = static_cast<std::size_t>(new_pos);
-
-    return true;
-}
+    virtual bool IsPure( const std::string& name ) {
+        return name == "twice";
+    }
 
+    int variable;
+    int twice;
+    int tick;
+};
 
-bool TextProcessor::Run( std::vector<std::string>* output ) {
-    std::string segment;
+#if TSUB_HAS_THREADS
+// Context without any state , so one instance is shared by all the threads.
+// Each list is created for the caller , a list value is not shared.
+class SharedContext : public tsub::Context {
+public:
+    SharedContext() {
+        tsub::ValueList* list = new tsub::ValueList();
+        list->AddValue(1);
+        list->AddValue(2);
+        list->AddValue(3);
+        ids_.SetList(list);
+
+        // 10 , 15 , ... , 35
+        tsub::ValueList* range = new tsub::ValueList();
+        range->SetRange(10,5,6);
+        range_.SetList(range);
+    }
 
-    // The run loop is simple, it just tries to read the text as long as possible
-    // Once it finds a expression , then it executes that one gets the result and
-    // then converts it to the string test , this process is called expansion.
-    // Then it goes back to find the text.
-
-    for( position_ = 0 ; position_ < input_->size() ; ++position_ ) {
-        if( input_->at(position_) == '\\' ) {
-            // Handle the escape characters in the stream
-            if( position_+1 < input_->size() ) {
-                if( IsEscapeChar( input_->at(position_+1) ) ) {
-                    ++position_;
-                    segment.push_back( input_->at(position_) );
-                    continue;
-                }
-            }
+    virtual bool GetVariable( const std::string& name , tsub::Value* val ) {
+        if( name == "n" ) {
+            val->SetNumber(7);
+        } else if( name == "ids" ) {
+            // Every thread gets a copy of the same list
+            *val = ids_;
+        } else if( name == "r" ) {
+            *val = range_;
         } else {
-            if( input_->at(position_) == '`' ) {
-                ++position_;
+            return false;
+        }
+        return true;
+    }
 
-                Value val;
-                std::vector<const std::string*> str_list;
+    virtual bool ExecFunction( const std::string& name ,
+                               const std::vector<tsub::Value>& par ,
+                               tsub::Value* ret ,
+                               std::string* ) {
+        if( name != "mul" )
+            return false;
+        ret->SetNumber( par[0].GetNumber() * par[1].GetNumber() );
+        return true;
+    }
 
-                // We need to put the segment that we currently have to the
-                // intermediate result sets now.
+    virtual bool IsPure( const std::string& name ) {
+        return name == "mul";
+    }
 
-                if( !segment.empty() ) {
-                    Expand( GetString(segment) );
-                    segment.clear();
-                }
+private:
+    tsub::Value ids_;
+    tsub::Value range_;
+};
+#endif // TSUB_HAS_THREADS
 
-                if( !ProcessExp(&val) )
-                    return false;
+// Context whose variables could be changed , it counts the lookups of each
+class VarContext : public tsub::Context {
+public:
+    virtual bool GetVariable( const std::string& name , tsub::Value* val ) {
+        std::map<std::string,tsub::Number>::iterator ib = var.find(name);
+        if( ib == var.end() )
+            return false;
+        ++lookup[name];
+        val->SetNumber(ib->second);
+        return true;
+    }
+
+    virtual bool ExecFunction( const std::string& name ,
+                               const std::vector<tsub::Value>& par ,
+                               tsub::Value* ret ,
+                               std::string* ) {
+        if( name != "neg" )
+            return false;
+        ++lookup[name];
+        ret->SetNumber( -par[0].GetNumber() );
+        return true;
+    }
 
-                // Convert value to string list
-                ValueToStringList(val,&str_list);
+    std::map<std::string,tsub::Number> var;
+    std::map<std::string,int> lookup;
+};
 
-                // Once we have the expression, we need to do concatenation
-                Concatenate(str_list);
+// Context that resolves its names into slots
+class SlotContext : public tsub::Context {
+public:
+    SlotContext():
+        resolve(0),
+        by_name(0),
+        by_id(0)
+        {}
 
-                // Loop again
-                continue;
-            } else {
-                // Just common text, put them into the segment buffer
-                segment.push_back( input_->at(position_) );
-            }
-        }
+    virtual bool GetVariable( const std::string& , tsub::Value* ) {
+        ++by_name;
+        return false;
     }
 
-    // Checking if the segment buffer has something we need to expand
-    if( !segment.empty() ) {
-        Expand( GetString(segment) );
+    virtual bool ExecFunction( const std::string& ,
+                               const std::vector<tsub::Value>& ,
+                               tsub::Value* ,
+                               std::string* ) {
+        ++by_name;
+        return false;
     }
 
-    // Now generate the result
-    GenerateResult( output );
-    return true;
-}
+    virtual SymbolId Resolve( const std::string& name ) {
+        ++resolve;
+        return name == "abcd" ? 0 : (name == "func" ? 1 : NO_SYMBOL);
+    }
 
-// Main text processing part
-// The special character ` is used to encapsulate the small expression
-// for execution. After execution, the output value will be converted
-// into the value set and concatenate with the existed text segment .
+    virtual bool GetVariableById( SymbolId id , tsub::Value* val ) {
+        assert( id == 0 );
+        ++by_id;
+        val->SetNumber(5);
+        return true;
+    }
 
-bool Run( Context* context ,
-    const std::string& input ,
-    std::vector<std::string>* output,
-    std::string* error_desp ) {
+    virtual bool ExecFunctionById( SymbolId id ,
+                                   const std::vector<tsub::Value>& par ,
+                                   tsub::Value* ret ,
+                                   std::string* ) {
+        assert( id == 1 );
+        ++by_id;
+        ret->SetNumber( par[0].GetNumber() + 1 );
+        return true;
+    }
 
-    TextProcessor processor(
-        input,context,error_desp);
+    int resolve;
+    int by_name;
+    int by_id;
+};
 
-    return processor.Run( output );
+// Copies share the list , which is copied only when it is modified
+void TestValue() {
+    using tsub::Value;
+    using tsub::ValueList;
+
+    ValueList* list = new ValueList();
+    list->AddValue(1);
+    list->AddValue("str");
+
+    Value a(list);
+    Value b(a);
+    assert( &a.GetList() == &b.GetList() );
+
+    // Integer literals , including 0 , construct numbers
+    Value zero(0) , big( static_cast<tsub::Number>(1) << 40 );
+    assert( zero.type() == Value::VALUE_NUMBER && zero.GetNumber() == 0 );
+    assert( big.GetNumber() == 1099511627776LL );
+    Value size( std::size_t(3) ) , uns( 0u ) , wide( 1LL ) , ulong( 5ul );
+    assert( size.GetNumber() == 3 && uns.GetNumber() == 0 );
+    assert( wide.GetNumber() == 1 && ulong.GetNumber() == 5 );
+    assert( Value( static_cast<tsub::Number>(-7) ).GetNumber() == -7 );
+
+    b.MutableList()->Index(0).SetNumber(2);
+    assert( &a.GetList() != &b.GetList() );
+    assert( a.GetList().Index(0).GetNumber() == 1 );
+    assert( b.GetList().Index(0).GetNumber() == 2 );
+    assert( b.GetList().Index(1).GetString() == "str" );
+
+    // Unique list is modified in place
+    ValueList* unique = b.MutableList();
+    assert( unique == b.MutableList() );
+
+    Value c("str2");
+    c.Swap(&b);
+    assert( c.type() == Value::VALUE_LIST && b.GetString() == "str2" );
+    a.Swap(&a);
+    assert( a.GetList().size() == 2 );
+
+    b = c;
+    c.SetNull();
+    assert( b.GetList().Index(0).GetNumber() == 2 );
 }
 
-}// namespace tsub
+// The vector loops must find the same delimiter as the plain one , at any
+// offset and next to the end of the text
+void TestFindDelimiter() {
+    for( std::size_t size = 0 ; size < 80 ; ++size ) {
+        std::string text( size , 'a' );
+        assert( tsub::FindDelimiter( text.data() , text.data() + size ) == text.data() + size );
+
+        for( std::size_t i = 0 ; i < size ; ++i ) {
+            text[i] = i % 2 ? '`' : '\\';
+            if( i + 3 < size )
+                text[i+3] = '`';
+            assert( tsub::FindDelimiter( text.data() , text.data() + size ) == text.data() + i );
+            assert( tsub::FindDelimiter( text.data() + i + 1 , text.data() + size ) ==
+                    text.data() + ( i + 3 < size ? i + 3 : size ) );
+            text.assign( size , 'a' );
+        }
+    }
+}
 
-#ifndef NDEBUG
 int main() {
     using tsub::Run;
     std::string error;
     std::vector<std::string> output;
 
+    TestStringPool();
+    TestValue();
+    TestFindDelimiter();
+    exp::TestVM();
+    exp::TestParserPiece();
+    exp::TestShortCircuit();
+
     assert( Run(NULL,
             "c\\``[ 1==1 ? 2:3 ..5 , 1{$*100}]`.http",
             &output,
@@ -1366,8 +5644,494 @@ int main() {
         std::cout<<*ib<<std::endl;
     }
 
+    // Compile once and expand multiple times
+    tsub::Template tmpl;
+    exp::TestContext context;
+    std::vector<std::string> again;
+
+    assert( tsub::Compile("`[1..3]{$+abcd}`-`func(abcd)`",&tmpl,&error) );
+    assert( tmpl.Expand(&context,&output,&error) );
+    assert( tmpl.Expand(&context,&again,&error) );
+    assert( output == again );
+    assert( output.size() == 2 && output[0] == "6-6" && output[1] == "7-6" );
+
+    // Each name is resolved once per expansion , then looked up by id
+    SlotContext slot;
+    assert( tmpl.Expand(&slot,&again,&error) );
+    assert( output == again );
+    assert( slot.resolve == 2 && slot.by_name == 0 && slot.by_id == 4 );
+
+    // Contiguous output buffer
+    tsub::OutputBuffer buffer('\n');
+    assert( Run(NULL,"a`[1..3]`-`[\"x\",\"yy\"]`",&buffer,&error) );
+    assert( buffer.size() == 4 );
+    assert( buffer.data() == "a1-x\na2-x\na1-yy\na2-yy\n" );
+    assert( buffer.Get(2) == "a1-yy" && buffer.string_size(3) == 5 );
+
+    // Large range is mapped and rendered without being expanded
+    {
+        std::vector<std::string> lazy;
+        assert( Run(NULL,"`[-10000..90000]{2*$+1}`,`[0..3]`",&lazy,&error) );
+        assert( lazy.size() == 300000 );
+        assert( lazy[0] == "-19999,0" && lazy[1] == "-19997,0" );
+        assert( lazy[100000] == "-19999,1" && lazy.back() == "179999,2" );
+
+        tsub::Expansion expansion;
+        tsub::Template tmpl;
+        std::string str;
+        assert( tsub::Compile("`[0..700000000]{$*3}`",&tmpl,&error) );
+        assert( tmpl.Evaluate(NULL,&expansion,&error) );
+        assert( expansion.At(699999999,&str) && str == "2099999997" );
+
+        // A large range nested in a list is rendered with the other elements
+        assert( Run(NULL,"`[[0..5000],1]`",&lazy,&error) );
+        assert( lazy.size() == 5001 && lazy[4999] == "4999" && lazy.back() == "1" );
+        assert( Run(NULL,"`[[0..5000],[0..5000]]`",&lazy,&error) );
+        assert( lazy.size() == 10000 && lazy[5000] == "0" && lazy.back() == "4999" );
+    }
+
+    // Memoized expansion
+    {
+        const char* input = "`host`-`host`-`twice(2)`-`[1,2]{twice(2)+twice($)}`-`tick(0)`-`tick(0)`";
+        tsub::Options options;
+        std::vector<std::string> plain , memo;
+
+        MemoCountContext c1;
+        assert( Run(&c1,input,&plain,&error) );
+        assert( c1.variable == 1 && c1.twice == 5 && c1.tick == 2 );
+
+        MemoCountContext c2;
+        options.memoize = true;
+        assert( Run(&c2,input,&memo,&error,options) );
+        assert( c2.variable == 1 && c2.twice == 2 && c2.tick == 2 );
+        assert( plain == memo && memo.size() == 2 && memo[1] == "h-h-4-8-1-2" );
+    }
+
+    // Same expression is evaluated once unless it calls an impure function
+    {
+        MemoCountContext context;
+        std::vector<std::string> output;
+        assert( Run(&context,"`twice(3)`/`host`?q=`twice(3)`&`host`=`tick(0)`-`tick(0)`",&output,&error) );
+        assert( output.size() == 1 && output[0] == "6/h?q=6&h=1-2" );
+        assert( context.variable == 1 && context.twice == 1 && context.tick == 2 );
+    }
+
+    // Batch shares the variable lookups
+    {
+        std::vector<std::string> input;
+        std::vector< std::vector<std::string> > batch;
+        input.push_back("a`abcd`");
+        input.push_back("`[1..3]{$+abcd}`-`func(abcd)`");
+        input.push_back("`abcd*2`");
+
+        SlotContext batch_slot;
+        assert( tsub::RunBatch(&batch_slot,input,&batch,&error) );
+        assert( batch.size() == 3 );
+        assert( batch[0].size() == 1 && batch[0][0] == "a5" );
+        assert( batch[1].size() == 2 && batch[1][1] == "7-6" );
+        assert( batch[2].size() == 1 && batch[2][0] == "10" );
+        assert( batch_slot.resolve == 2 && batch_slot.by_name == 0 );
+        // Variable once , function once
+        assert( batch_slot.by_id == 2 );
+
+        for( std::size_t i = 0 ; i < input.size() ; ++i ) {
+            std::vector<std::string> single;
+            assert( Run(&batch_slot,input[i],&single,&error) );
+            assert( single == batch[i] );
+        }
+
+        input.push_back("`1/0`");
+        assert( !tsub::RunBatch(&batch_slot,input,&batch,&error) );
+        assert( error.find("[Module:Batch,Index:3]") == 0 );
+        input.back() = "`1/`";
+        assert( !tsub::RunBatch(&batch_slot,input,&batch,&error) );
+        assert( error.find("[Module:Batch,Index:3]") == 0 );
+
+        // The same text is compiled once and its names are resolved once
+        tsub::TemplateCache cache;
+        tsub::Options options;
+        options.cache = &cache;
+        SlotContext repeat_slot;
+        input.assign( 3 , "`abcd`-`func(abcd)`" );
+        input.push_back("`[1,2]`");
+        assert( tsub::RunBatch(&repeat_slot,input,&batch,&error,options) );
+        assert( batch.size() == 4 && batch[0] == batch[2] && batch[2][0] == "5-6" );
+        assert( batch[3].size() == 2 );
+        assert( cache.GetStats().misses == 2 && cache.GetStats().hits == 0 );
+        assert( repeat_slot.resolve == 2 );
+    }
+
+    // Random access
+    {
+        tsub::Template tmpl;
+        assert( tsub::Compile("x`[1..4]`-`[\"a\",\"b\"]`-`[7..10]{$*2}`",&tmpl,&error) );
+
+        std::vector<std::string> all;
+        assert( tmpl.Expand(NULL,&all,&error) );
+
+        tsub::Expansion expansion;
+        assert( tmpl.Evaluate(NULL,&expansion,&error) );
+
+        std::size_t count;
+        assert( expansion.Count(&count) && count == all.size() && count == 18 );
+
+        std::string str;
+        for( std::size_t i = 0 ; i < all.size() ; ++i ) {
+            assert( expansion.At(i,&str) );
+            assert( str == all[i] );
+        }
+        assert( !expansion.At(all.size(),&str) );
+        assert( tmpl.At(NULL,7,&str,&error) && str == all[7] );
+
+        CountSink sink(100);
+        expansion.Range(5,9,&sink);
+        assert( sink.count == 4 && sink.last == all[8] );
+        expansion.Range(16,100,&sink);
+        assert( sink.count == 6 && sink.last == all[17] );
+
+        // Count overflows , but each output is still reachable
+        assert( tsub::Compile("`[0..100000]``[0..100000]``[0..100000]`"
+                              "`[0..100000]``[0..100000]`",&tmpl,&error) );
+        assert( !tmpl.Count(NULL,&count,&error) );
+        assert( tmpl.At(NULL,static_cast<std::size_t>(-1),&str,&error) );
+    }
+
+    // Parallel expansion keeps the sequential order
+    {
+        tsub::Options options;
+        options.threads = 4;
+        options.parallel_threshold = 1;
+        const char* input = "`[1..7]`-`[\"a\",\"bb\",\"\"]`/`[10..23]{$*$}`";
+
+        std::vector<std::string> seq , par;
+        assert( Run(NULL,input,&seq,&error) );
+        assert( Run(NULL,input,&par,&error,options) );
+        assert( seq.size() == 6*3*13 && seq == par );
+
+        tsub::OutputBuffer seq_buf('\n') , par_buf('\n');
+        assert( Run(NULL,input,&seq_buf,&error) );
+        assert( Run(NULL,input,&par_buf,&error,options) );
+        assert( seq_buf.data() == par_buf.data() );
+        assert( seq_buf.offsets() == par_buf.offsets() );
+    }
+
+    // Long literal text around the commands and the escapes
+    {
+        std::string text( 100 , 'x' );
+        std::string input = text + "\\`" + text + "`[1,2]`" + text + "\\\\" + text + "\\q";
+        assert( Run(NULL,input,&output,&error) );
+        assert( output.size() == 2 );
+        assert( output[1] == text + "`" + text + "2" + text + "\\" + text + "q" );
+    }
+
+    // Only the commands that reference a changed variable are evaluated
+    // again by Update
+    {
+        VarContext context;
+        context.var["a"] = 1;
+        context.var["b"] = 2;
+
+        tsub::Template tmpl;
+        tsub::Expansion expansion;
+        assert( tsub::Compile("x`a`-`[b..b+3]`-`neg(b)`-`[0..5000]{$+a}`/`a`",&tmpl,&error) );
+        assert( tmpl.Evaluate(&context,&expansion,&error) );
+
+        context.var["a"] = 10;
+        std::vector<std::string> names( 1 , "a" );
+        assert( tmpl.Update(&context,names,&expansion,&error) );
+        assert( context.lookup["b"] == 3 && context.lookup["neg"] == 1 );
+
+        std::vector<std::string> expect;
+        std::string str;
+        std::size_t count;
+        assert( tmpl.Expand(&context,&expect,&error) );
+        assert( expansion.Count(&count) && count == expect.size() );
+        for( std::size_t i = 0 ; i < expect.size() ; i += 97 ) {
+            assert( expansion.At(i,&str) && str == expect[i] );
+        }
+        assert( expansion.At(expect.size()-1,&str) && str == "x10-4--2-5009/10" );
+
+        context.var["b"] = 5;
+        names[0] = "b";
+        names.push_back("neg");
+        names.push_back("unknown");
+        assert( tmpl.Update(&context,names,&expansion,&error) );
+        assert( expansion.At(0,&str) && str == "x10-5--5-10/10" );
+
+        // Failure keeps the expansion
+        context.var.erase("b");
+        assert( !tmpl.Update(&context,names,&expansion,&error) );
+        assert( expansion.At(0,&str) && str == "x10-5--5-10/10" );
+
+        // Expansion of another template is evaluated from scratch
+        tsub::Template other;
+        assert( tsub::Compile("`a`",&other,&error) );
+        assert( other.Update(&context,names,&expansion,&error) );
+        assert( expansion.Count(&count) && count == 1 );
+    }
+
+    // Diff of two expansions is the set difference of their outputs
+    {
+        VarContext context;
+        context.var["a"] = 1;
+        context.var["b"] = 2;
+
+        tsub::Template tmpl;
+        tsub::Expansion before , after;
+        assert( tsub::Compile("`[a..a+4]`-`[b,b+1,b,7]`-`[0..3]{$*a}`.`[\"x\",\"y\"]`",&tmpl,&error) );
+        assert( tmpl.Evaluate(&context,&before,&error) );
+
+        std::vector<std::string> added , removed;
+        tsub::VectorSink add_sink(&added) , remove_sink(&removed);
+        assert( !after.Diff(before,&add_sink,&remove_sink) );
+
+        // Nothing changed
+        assert( tmpl.Evaluate(&context,&after,&error) );
+        assert( after.Diff(before,&add_sink,&remove_sink) );
+        assert( added.empty() && removed.empty() );
+
+        const int kValue[][2] = { {2,2} , {1,3} , {3,7} , {10,20} };
+        for( std::size_t k = 0 ; k < sizeof(kValue)/sizeof(kValue[0]) ; ++k ) {
+            std::vector<std::string> old_output , new_output;
+            assert( tmpl.Expand(&context,&old_output,&error) );
+
+            context.var["a"] = kValue[k][0];
+            context.var["b"] = kValue[k][1];
+            std::vector<std::string> names( 1 , "a" );
+            names.push_back("b");
+            assert( tmpl.Update(&context,names,&after,&error) );
+            assert( tmpl.Expand(&context,&new_output,&error) );
+
+            added.clear();
+            removed.clear();
+            assert( after.Diff(before,&add_sink,&remove_sink) );
+
+            std::set<std::string> old_set( old_output.begin() , old_output.end() );
+            std::set<std::string> new_set( new_output.begin() , new_output.end() );
+            std::vector<std::string> expect_added , expect_removed;
+            for( std::set<std::string>::iterator ib = new_set.begin() ; ib != new_set.end() ; ++ib ) {
+                if( old_set.count(*ib) == 0 )
+                    expect_added.push_back(*ib);
+            }
+            for( std::set<std::string>::iterator ib = old_set.begin() ; ib != old_set.end() ; ++ib ) {
+                if( new_set.count(*ib) == 0 )
+                    expect_removed.push_back(*ib);
+            }
+
+            // Each output is passed only once
+            std::sort( added.begin() , added.end() );
+            std::sort( removed.begin() , removed.end() );
+            assert( added == expect_added );
+            assert( removed == expect_removed );
+
+            before.Swap(&after);
+        }
+
+        // Either side could be skipped
+        context.var["a"] = 0;
+        std::vector<std::string> names( 1 , "a" );
+        assert( tmpl.Update(&context,names,&after,&error) );
+        removed.clear();
+        assert( after.Diff(before,NULL,&remove_sink) );
+        assert( !removed.empty() );
+
+        // Expansions of different templates are not compared
+        tsub::Template other;
+        assert( tsub::Compile("`[a..a+4]`-`[b,b+1,b,7]`-`[0..3]{$*a}`.`[\"x\",\"y\"]`",&other,&error) );
+        assert( other.Evaluate(&context,&before,&error) );
+        assert( !after.Diff(before,&add_sink,&remove_sink) );
+    }
+
+    // Template cache
+    {
+        tsub::TemplateCache cache;
+        tsub::Template first , second;
+
+        assert( cache.Get("a`[1..3]`",&first,&error) );
+        assert( cache.Get("a`[1..3]`",&second,&error) );
+        assert( !cache.Get("a`[1..`",&second,&error) );
+        assert( !cache.Get("a`[1..`",&second,&error) );
+
+        tsub::TemplateCache::Stats stats = cache.GetStats();
+        assert( stats.hits == 1 && stats.misses == 3 && stats.entries == 1 );
+
+        // The input of Run goes through the cache
+        tsub::Options options;
+        options.cache = &cache;
+        assert( Run(NULL,"a`[1..3]`",&output,&error,options) );
+        assert( output.size() == 2 && output[1] == "a2" );
+        assert( cache.GetStats().hits == 2 );
+
+        // One shard that only fits a few templates , the least recently
+        // used one is dropped
+        tsub::Template tmpl;
+        tsub::TemplateCache small( 3000 , 1 );
+        assert( small.Get("`[1..3]`",&tmpl,&error) );
+        for( int i = 0 ; i < 20 ; ++i ) {
+            char input[64];
+            sprintf(input,"%d`[1..3]`",i);
+            assert( small.Get(input,&tmpl,&error) );
+            assert( small.Get("`[1..3]`",&tmpl,&error) );
+        }
+        stats = small.GetStats();
+        assert( stats.evictions > 0 && stats.bytes <= 3000 );
+        assert( stats.hits == 20 && stats.misses == 21 );
+        assert( tmpl.Expand(NULL,&output,&error) && output.size() == 2 );
+
+        small.Clear();
+        assert( small.GetStats().entries == 0 );
+    }
+
+#if TSUB_HAS_THREADS
+    // Threads share the cache and the templates it hands out
+    {
+        tsub::TemplateCache cache( 1 << 20 , 4 );
+        std::vector<std::thread> threads;
+        std::vector<int> failure(8,0);
+
+        for( int t = 0 ; t < 8 ; ++t ) {
+            threads.push_back( std::thread( [&cache,&failure,t]() {
+                for( int i = 0 ; i < 200 ; ++i ) {
+                    char input[64];
+                    sprintf(input,"`[0..%d]`-x",(i+t)%16+1);
+                    tsub::Template tmpl;
+                    std::vector<std::string> out;
+                    std::string err;
+                    if( !cache.Get(input,&tmpl,&err) ||
+                        !tmpl.Expand(NULL,&out,&err) ||
+                        out.size() != static_cast<std::size_t>((i+t)%16+1) )
+                        ++failure[t];
+                }
+            }));
+        }
+        for( std::size_t t = 0 ; t < threads.size() ; ++t )
+            threads[t].join();
+
+        for( std::size_t t = 0 ; t < failure.size() ; ++t )
+            assert( failure[t] == 0 );
+        tsub::TemplateCache::Stats stats = cache.GetStats();
+        assert( stats.hits + stats.misses == 1600 && stats.entries == 16 );
+    }
+#endif // TSUB_HAS_THREADS
+
+#if TSUB_HAS_THREADS
+    // One compiled template expanded by many threads at the same time , each
+    // expansion has its own scratch state
+    {
+        SharedContext context;
+        tsub::Template shared;
+        assert( tsub::Compile("x`[1..4]`-`ids{mul($,n)}`/`[0..50]{$*3+1}`-`n`-"
+                              "`ids{mul($,n)}`.`r{$ > 20 ? $ : n}`-`r{$*2}`-`\"a\"`",&shared,&error) );
+
+        std::vector<std::string> expect;
+        assert( shared.Expand(&context,&expect,&error) );
+        assert( expect.size() == 3*3*50*3*6*6 );
+        assert( expect.back() == "x3-21/148-7-21.35-70-a" );
+
+        std::vector<std::thread> threads;
+        std::vector<int> failure(8,0);
+
+        for( int t = 0 ; t < 8 ; ++t ) {
+            threads.push_back( std::thread( [&,t]() {
+                tsub::Template tmpl(shared);
+                tsub::Options options;
+                options.memoize = t % 2 == 0;
+                for( int i = 0 ; i < 4 ; ++i ) {
+                    std::vector<std::string> out;
+                    tsub::OutputBuffer buffer;
+                    tsub::Expansion expansion;
+                    std::string err , str;
+                    std::size_t count;
+
+                    if( !tmpl.Expand(&context,&out,&err,options) || out != expect )
+                        ++failure[t];
+                    if( !shared.Expand(&context,&buffer,&err,options) ||
+                        buffer.size() != expect.size() ||
+                        buffer.Get(expect.size()-1) != expect.back() )
+                        ++failure[t];
+                    if( !shared.Evaluate(&context,&expansion,&err) ||
+                        !expansion.Count(&count) || count != expect.size() ||
+                        !expansion.At(t*1000+i,&str) || str != expect[t*1000+i] )
+                        ++failure[t];
+
+                    // The cached range is read in place by every thread
+                    tsub::Value range;
+                    tsub::Number sum = 0;
+                    context.GetVariable("r",&range);
+                    for( std::size_t k = 0 ; k < range.GetList().size() ; ++k )
+                        sum += range.GetList().Index(k).GetNumber();
+                    if( sum != 135 )
+                        ++failure[t];
+                }
+            }));
+        }
+        for( std::size_t t = 0 ; t < threads.size() ; ++t )
+            threads[t].join();
+        for( std::size_t t = 0 ; t < failure.size() ; ++t )
+            assert( failure[t] == 0 );
+    }
+#endif // TSUB_HAS_THREADS
+
+    // Constant segments are rendered at compile time , errors still wait
+    // for the expansion
+    {
+        tsub::Template tmpl;
+        std::vector<std::string> output;
+
+        assert( tsub::Compile("x`[1*2..3*2]`-`1==1 ? \"a\" : b`-`0 && f(1)``[1,2]{$*10}`",&tmpl,&error) );
+        assert( tmpl.Expand(NULL,&output,&error) );
+        assert( output.size() == 8 && output[0] == "x2-a-010" && output[7] == "x5-a-020" );
+
+        assert( tsub::Compile("`[1..3]`-`a`-`[\"x\",\"y\"]`",&tmpl,&error) );
+        assert( !tmpl.Expand(NULL,&output,&error) );
+
+        assert( tsub::Compile("a`1/0`b",&tmpl,&error) );
+        assert( !tmpl.Expand(NULL,&output,&error) );
+        assert( error.find("Divide zero!") != std::string::npos );
+    }
+
+    // 64 bit numbers , the overflow is an error instead of wrapping around
+    {
+        assert( Run(NULL,"`9223372036854775807`/`-9223372036854775807-1`",&output,&error) );
+        assert( output.size() == 1 && output[0] == "9223372036854775807/-9223372036854775808" );
+
+        assert( !Run(NULL,"`9223372036854775808`",&output,&error) );
+        assert( error.find("out of range") != std::string::npos );
+
+        assert( !Run(NULL,"`[1,2]{$*4611686018427387904}`",&output,&error) );
+        assert( error.find("Integer overflow!") != std::string::npos );
+
+        // The symbolic range is mapped when no number overflows , otherwise
+        // the overflow is reported
+        std::size_t count;
+        std::string str;
+        tsub::Template tmpl;
+        tsub::Expansion expansion;
+        assert( tsub::Compile("`[0..100000]{$*92233720368547+100000}`",&tmpl,&error) );
+        assert( tmpl.Evaluate(NULL,&expansion,&error) );
+        assert( expansion.Count(&count) && count == 100000 );
+        assert( expansion.At(count-1,&str) && str == "9223279803134431453" );
+
+        assert( tsub::Compile("`[0..100001]{$*92233720368547+100000}`",&tmpl,&error) );
+        assert( !tmpl.Evaluate(NULL,&expansion,&error) );
+        assert( error.find("Integer overflow!") != std::string::npos );
+
+        assert( Run(NULL,"`[9223372036854775800..9223372036854775807]{$+1}`",&output,&error) );
+        assert( output.size() == 7 && output[6] == "9223372036854775807" );
+
+        // The context hands out large numbers directly
+        VarContext context;
+        context.var["ts"] = 1700000000123LL;
+        assert( Run(&context,"`ts/1000`.`ts-ts/1000*1000`",&output,&error) );
+        assert( output.size() == 1 && output[0] == "1700000000.123" );
+    }
+
+    // Streaming expansion , the product is never materialized
+    CountSink sink(1000);
+    assert( Run(NULL,"`[0..100]``[0..100]``[0..100]`",&sink,&error) );
+    assert( sink.count == 1000 && sink.last == "9990" );
+
     return 0;
 }
 #endif
 
-
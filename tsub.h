@@ -4,11 +4,44 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <utility>
 #include <cassert>
+#include <stdint.h>
+
+// Worker threads need C++11 , a C++03 build always expands sequentially
+#ifndef TSUB_HAS_THREADS
+#if __cplusplus >= 201103L
+#define TSUB_HAS_THREADS 1
+#else
+#define TSUB_HAS_THREADS 0
+#endif
+#endif // TSUB_HAS_THREADS
+
+#if TSUB_HAS_THREADS
+#include <atomic>
+#endif // TSUB_HAS_THREADS
 
 namespace tsub {
 
+#if __cplusplus >= 201103L
+#define TSUB_HAS_MOVE 1
+#else
+#define TSUB_HAS_MOVE 0
+#endif // __cplusplus >= 201103L
+
 class ValueList;
+
+// Number of the expression , a 64 bit signed integer. The arithmetic is
+// checked and an overflow is reported as an error.
+typedef int64_t Number;
+
+// Value of the expression. The list storage is reference counted, so copying
+// a value is O(1) no matter how long the list is. The list is shared between
+// the copies and it is copied only when it is going to be modified through
+// MutableList. With the thread support the reference count is atomic and a
+// range list is read without creating its elements , so copies of one list
+// value , a range included , could be made , read and dropped by different
+// threads.
 class Value {
 public:
     enum {
@@ -23,19 +56,51 @@ public:
             ::new (GetStringPtr()) std::string(str);
         }
 
+    // One constructor per integral type , so Value(0) is not ambiguous with
+    // the list pointer and Value(std::size_t) or Value(1LL) picks an exact
+    // match whatever type Number is on the platform. All of them store a
+    // Number , an unsigned value above the Number range wraps around.
     explicit Value( int val ):
         type_( VALUE_NUMBER ) {
-            *GetNumberPtr() = val;
+            *GetNumberPtr() = static_cast<Number>(val);
+        }
+
+    explicit Value( unsigned int val ):
+        type_( VALUE_NUMBER ) {
+            *GetNumberPtr() = static_cast<Number>(val);
+        }
+
+    explicit Value( long val ):
+        type_( VALUE_NUMBER ) {
+            *GetNumberPtr() = static_cast<Number>(val);
+        }
+
+    explicit Value( unsigned long val ):
+        type_( VALUE_NUMBER ) {
+            *GetNumberPtr() = static_cast<Number>(val);
+        }
+
+    explicit Value( long long val ):
+        type_( VALUE_NUMBER ) {
+            *GetNumberPtr() = static_cast<Number>(val);
         }
 
+    explicit Value( unsigned long long val ):
+        type_( VALUE_NUMBER ) {
+            *GetNumberPtr() = static_cast<Number>(val);
+        }
+
+    // Take the ownership of the list, which must be allocated by new
     explicit Value( ValueList* l ):
         type_( VALUE_LIST ) {
             buffer_.value_list = l;
+            Retain();
         }
 
     explicit Value( const ValueList& l ):
         type_( VALUE_LIST ) {
             buffer_.value_list = CopyList(l);
+            Retain();
         }
 
     Value() :
@@ -56,11 +121,39 @@ public:
         return *this;
     }
 
+#if TSUB_HAS_MOVE
+    Value( Value&& val ) noexcept :
+        type_( VALUE_NULL ) {
+            MoveFrom(&val);
+        }
+
+    Value& operator = ( Value&& val ) noexcept {
+        if( &val == this )
+            return *this;
+        Detach();
+        type_ = VALUE_NULL;
+        MoveFrom(&val);
+        return *this;
+    }
+#endif // TSUB_HAS_MOVE
+
+    // Exchange the content with another value without copying anything ,
+    // the way to move a value in C++03
+    void Swap( Value* val ) {
+        if( val == this )
+            return;
+        Value temp;
+        temp.MoveFrom(this);
+        MoveFrom(val);
+        val->MoveFrom(&temp);
+    }
+
     ~Value() {
         Detach();
     }
 
     void SetList( ValueList* list ) {
+        Retain(list);
         Detach();
         type_ = VALUE_LIST;
         buffer_.value_list = list;
@@ -72,7 +165,13 @@ public:
         ::new (GetStringPtr()) std::string(str);
     }
 
-    void SetNumber( int val ) {
+    void SetString( const char* data , std::size_t size ) {
+        Detach();
+        type_ = VALUE_STRING;
+        ::new (GetStringPtr()) std::string(data,size);
+    }
+
+    void SetNumber( Number val ) {
         Detach();
         type_ = VALUE_NUMBER;
         *GetNumberPtr() = val;
@@ -93,7 +192,7 @@ public:
         return *GetStringPtr();
     }
 
-    int GetNumber() const {
+    Number GetNumber() const {
         assert( type_ == VALUE_NUMBER );
         return *GetNumberPtr();
     }
@@ -103,6 +202,10 @@ public:
         return *buffer_.value_list;
     }
 
+    // The list that could be modified , it is copied first if it is shared
+    // with other values
+    inline ValueList* MutableList();
+
     bool IsNull() const {
         return type_ == VALUE_NULL;
     }
@@ -120,13 +223,42 @@ private:
                 *GetNumberPtr() = val.GetNumber();
                 return;
             case VALUE_LIST:
-                buffer_.value_list = CopyList( val.GetList() );
+                buffer_.value_list = val.buffer_.value_list;
+                Retain();
                 return;
             default:
                 return;
         }
     }
 
+    // Steal the content of val and leave it null , this value must be null
+    void MoveFrom( Value* val ) {
+        assert( type_ == VALUE_NULL );
+        switch( val->type_ ) {
+            case VALUE_STRING:
+                ::new (GetStringPtr()) std::string();
+                GetStringPtr()->swap( *val->GetStringPtr() );
+                val->Detach();
+                break;
+            case VALUE_NUMBER:
+                *GetNumberPtr() = val->GetNumber();
+                break;
+            case VALUE_LIST:
+                buffer_.value_list = val->buffer_.value_list;
+                break;
+            default:
+                break;
+        }
+        type_ = val->type_;
+        val->type_ = VALUE_NULL;
+    }
+
+    inline void Retain( ValueList* list );
+
+    void Retain() {
+        Retain(buffer_.value_list);
+    }
+
     std::string* GetStringPtr() {
         return reinterpret_cast<std::string*>(
             buffer_.string_buffer);
@@ -137,11 +269,11 @@ private:
             buffer_.string_buffer);
     }
 
-    int* GetNumberPtr() {
+    Number* GetNumberPtr() {
         return &(buffer_.number_buffer);
     }
 
-    const int* GetNumberPtr() const {
+    const Number* GetNumberPtr() const {
         return &(buffer_.number_buffer);
     }
 
@@ -151,7 +283,7 @@ private:
 
     union {
         char string_buffer[sizeof(std::string)];
-        int number_buffer;
+        Number number_buffer;
         ValueList* value_list;
     } buffer_;
 
@@ -164,46 +296,151 @@ private:
 
 class ValueList {
 public:
-    ValueList(){}
+    ValueList():
+        ref_count_(0),
+        range_(false),
+        start_(0),
+        step_(0),
+        count_(0)
+        {}
+
     // Add the value at the back of the list
     void AddValue( const std::string& val ) {
-        list_.push_back( Value(val) );
+        Flatten();
+        list_.push_back( Value() );
+        list_.back().SetString(val);
     }
 
-    void AddValue( int val ) {
+    void AddValue( Number val ) {
+        Flatten();
         list_.push_back( Value(val) );
     }
 
     void AddValue( const Value& val ) {
+        Flatten();
         list_.push_back(val);
     }
 
+#if TSUB_HAS_MOVE
+    void AddValue( Value&& val ) {
+        Flatten();
+        list_.push_back( std::move(val) );
+    }
+#endif // TSUB_HAS_MOVE
+
+    // Add a null value at the back of the list and return it , so it could
+    // be filled in place
+    Value& Append() {
+        Flatten();
+        list_.push_back( Value() );
+        return list_.back();
+    }
+
+    void Reserve( std::size_t size ) {
+        list_.reserve(size);
+    }
+
     // Delete the value from the back of the list
     void DelValue();
 
     std::size_t size() const {
-        return list_.size();
+        return range_ ? count_ : list_.size();
     }
 
-    const Value& Index( int index ) const {
+    // The index-th value. The number of a range is computed on the fly , so
+    // reading a list never modifies it and a list shared by many threads
+    // could be read by all of them.
+    Value Index( int index ) const {
+        if( range_ )
+            return Value( RangeAt(index) );
+        return list_[index];
+    }
+
+    // The index-th value without a copy , the list must not be a range
+    const Value& Element( std::size_t index ) const {
+        assert( !range_ );
         return list_[index];
     }
 
     Value& Index( int index ) {
+        Flatten();
         return list_[index];
     }
 
     void Clear() {
         list_.clear();
+        range_ = false;
+    }
+
+    // Range of numbers , start , start+step , ... , which is kept symbolic
+    // until any element is accessed or the list is modified , so a large
+    // range costs no memory. The arithmetic wraps around in 64 bits.
+    void SetRange( Number start , Number step , std::size_t count ) {
+        list_.clear();
+        range_ = true;
+        start_ = start;
+        step_ = step;
+        count_ = count;
+    }
+
+    bool IsRange() const {
+        return range_;
+    }
+
+    Number range_start() const {
+        assert( range_ );
+        return start_;
+    }
+
+    Number range_step() const {
+        assert( range_ );
+        return step_;
+    }
+
+    Number RangeAt( std::size_t index ) const {
+        assert( range_ );
+        return static_cast<Number>( static_cast<uint64_t>(start_) +
+            static_cast<uint64_t>(index) * static_cast<uint64_t>(step_) );
+    }
+
+private:
+    // Turn the range into a normal list before it is modified , this is the
+    // only place where the elements of a range are created
+    void Flatten() {
+        if( !range_ )
+            return;
+        list_.clear();
+        list_.reserve(count_);
+        for( std::size_t i = 0 ; i < count_ ; ++i )
+            list_.push_back( Value( RangeAt(i) ) );
+        range_ = false;
     }
 
 private:
     std::vector< Value > list_;
 
+    // Number of values that share this list
+#if TSUB_HAS_THREADS
+    std::atomic<int> ref_count_;
+#else
+    int ref_count_;
+#endif // TSUB_HAS_THREADS
+
+    bool range_;
+    Number start_;
+    Number step_;
+    std::size_t count_;
+
     ValueList( const ValueList& );
     ValueList& operator = ( const ValueList& );
+
+    friend class Value;
 };
 
+inline void Value::Retain( ValueList* list ) {
+    ++list->ref_count_;
+}
+
 inline void Value::Detach() {
     if( type_ == VALUE_STRING ) {
         using std::string;
@@ -213,13 +450,27 @@ inline void Value::Detach() {
         return;
 
     } else if( type_ == VALUE_LIST ) {
-        delete buffer_.value_list;
+        if( --buffer_.value_list->ref_count_ == 0 )
+            delete buffer_.value_list;
         return;
     }
 }
 
+inline ValueList* Value::MutableList() {
+    assert( type_ == VALUE_LIST );
+    if( buffer_.value_list->ref_count_ > 1 )
+        SetList( CopyList(*buffer_.value_list) );
+    return buffer_.value_list;
+}
+
 class Context {
 public:
+    // Id of a resolved variable or function name
+    typedef int SymbolId;
+
+    enum {
+        NO_SYMBOL = -1
+    };
 
     virtual bool GetVariable( const std::string& var, Value* val ) = 0;
     virtual bool ExecFunction( const std::string& name,
@@ -227,13 +478,385 @@ public:
                                Value* ret,
                                std::string* error ) =0;
 
+    // Optional symbol binding. During an expansion each name referenced by
+    // the template is passed to Resolve at most once. If an id other than
+    // NO_SYMBOL is returned , all the lookups of that name go through the
+    // id based functions below , so no string is built or compared on the
+    // hot path. By default nothing is resolved and the name based functions
+    // above are used.
+    virtual SymbolId Resolve( const std::string& ) {
+        return NO_SYMBOL;
+    }
+
+    virtual bool GetVariableById( SymbolId , Value* ) {
+        return false;
+    }
+
+    virtual bool ExecFunctionById( SymbolId ,
+                                   const std::vector<Value>& ,
+                                   Value* ,
+                                   std::string* ) {
+        return false;
+    }
+
+    // Whether the function always returns the same result for the same
+    // arguments and has no side effect. With Options::memoize , such function
+    // is called only once per argument list during an expansion.
+    virtual bool IsPure( const std::string& ) {
+        return false;
+    }
+
     virtual ~Context() {}
 };
 
+// Receiver of the streaming expansion. The output strings are generated one
+// by one and passed to Emit , the buffer is reused after Emit returns , so
+// copy it if you need to keep it. Return false to stop the expansion early.
+
+class Sink {
+public:
+    virtual bool Emit( const std::string& output ) = 0;
+
+    virtual ~Sink() {}
+};
+
+// All the output strings in one contiguous buffer , stored back to back and
+// each one followed by the separator if it is set. The whole buffer could be
+// handed to write() directly , and the offsets tell where each string starts.
+// No memory is allocated per output string.
+
+class TextProcessor;
+class OutputBuffer {
+public:
+    OutputBuffer():
+        separator_('\0'),
+        has_separator_(false) {
+            offset_.push_back(0);
+        }
+
+    explicit OutputBuffer( char separator ):
+        separator_(separator),
+        has_separator_(true) {
+            offset_.push_back(0);
+        }
+
+    // Number of output strings
+    std::size_t size() const {
+        return offset_.size() - 1;
+    }
+
+    // The whole buffer , separators included
+    const std::string& data() const {
+        return data_;
+    }
+
+    // Offset of each string inside of the buffer , there are size()+1
+    // elements and the last one is the size of the buffer
+    const std::vector<std::size_t>& offsets() const {
+        return offset_;
+    }
+
+    // The index-th string , separator is not included
+    const char* string_data( std::size_t index ) const {
+        return data_.data() + offset_[index];
+    }
+
+    std::size_t string_size( std::size_t index ) const {
+        return offset_[index+1] - offset_[index] - (has_separator_ ? 1 : 0);
+    }
+
+    std::string Get( std::size_t index ) const {
+        return std::string( string_data(index) , string_size(index) );
+    }
+
+    void SetSeparator( char separator ) {
+        separator_ = separator;
+        has_separator_ = true;
+    }
+
+    void Clear() {
+        data_.clear();
+        offset_.resize(1);
+    }
+
+private:
+    std::string data_;
+    std::vector<std::size_t> offset_;
+    char separator_;
+    bool has_separator_;
+
+    friend class TextProcessor;
+};
+
+// Options of the expansion.
+
+class TemplateCache;
+struct Options {
+    // Number of worker threads used to join the output strings of the
+    // vector and OutputBuffer expansion , 0 means one per hardware thread.
+    // The output order is always the same as the sequential expansion.
+    // It is ignored if the library is built without thread support.
+    unsigned int threads;
+
+    // Smaller product is always joined by the calling thread , since it is
+    // not worth starting the workers
+    std::size_t parallel_threshold;
+
+    // Remember the variables and the results of the pure functions during
+    // an expansion , so each variable is looked up once and each pure
+    // function is called once per argument list
+    bool memoize;
+
+    // The input of tsub::Run and tsub::RunBatch is compiled through this
+    // cache if it is set , so the same text is only compiled once
+    TemplateCache* cache;
+
+    Options():
+        threads(1),
+        parallel_threshold(16384),
+        memoize(false),
+        cache(NULL)
+    {}
+};
+
+// Result of evaluating a template against a context. Only the string list
+// of each command is kept , the output strings are generated on demand. So
+// the number of outputs or any slice of them is available without expanding
+// the whole product , which makes it cheap to shard a huge expansion. The
+// output with index i is the i-th string of the normal expansion.
+
+class ExpansionImpl;
+class Expansion {
+public:
+    Expansion();
+    ~Expansion();
+
+    // Number of output strings , returns false if it does not fit into
+    // std::size_t. Each index is still accessible in that case.
+    bool Count( std::size_t* count ) const;
+
+    // The index-th output string , returns false if it is out of range
+    bool At( std::size_t index , std::string* output ) const;
+
+    // Pass the output strings in [begin,end) to the sink , the range is
+    // clipped to the number of outputs
+    void Range( std::size_t begin , std::size_t end , Sink* sink ) const;
+
+    // Difference between the previous expansion and this one , both must be
+    // evaluated from the same template , otherwise it returns false. The
+    // outputs that only this expansion generates are passed to added and the
+    // ones that only the previous expansion generates are passed to removed ,
+    // either sink could be NULL. It is computed from the string list of each
+    // command , so only the commands whose list changed produce outputs and
+    // the unchanged outputs are never generated. An output is identified by
+    // the strings of its commands , the same text joined from different
+    // strings is not treated as the same output.
+    bool Diff( const Expansion& previous , Sink* added , Sink* removed ) const;
+
+    void Swap( Expansion* other );
+
+    bool IsNull() const {
+        return impl_ == NULL;
+    }
+
+private:
+    ExpansionImpl* impl_;
+
+    Expansion( const Expansion& );
+    Expansion& operator = ( const Expansion& );
+
+    friend class Template;
+};
+
+// Compiled template. The input text is scanned and each expression inside
+// of it is parsed only once by Compile, then the template can be expanded
+// against different contexts as many times as you want. Copying a template
+// is cheap since the compiled form is shared and never modified.
+//
+// With the thread support , a template could be expanded by many threads at
+// the same time , all the scratch state of an expansion lives in the call.
+// The copies of a template could be made and dropped by any thread , but a
+// single Template object must not be assigned while others read it. The
+// context is called from the expanding thread , so a context shared by the
+// threads must be thread safe itself. It could hand the same cached list
+// Value , a range included , to all of them since reading a list never
+// modifies it.
+
+class TemplateImpl;
+class Template {
+public:
+    Template();
+    Template( const Template& tmpl );
+    Template& operator = ( const Template& tmpl );
+    ~Template();
+
+    // Evaluate all the expressions against the context and generate the
+    // output strings, it is same as Run but without parsing.
+    bool Expand( Context* ctx ,
+                 std::vector<std::string>* output ,
+                 std::string* error_description ,
+                 const Options& options = Options() ) const;
+
+    // Streaming version of the expansion. Only the string list of each
+    // segment is kept in memory , not the whole cartesian product.
+    bool Expand( Context* ctx ,
+                 Sink* sink ,
+                 std::string* error_description ,
+                 const Options& options = Options() ) const;
+
+    // Expand into a contiguous output buffer , the exact size of the buffer
+    // is computed before the strings are joined into it.
+    bool Expand( Context* ctx ,
+                 OutputBuffer* output ,
+                 std::string* error_description ,
+                 const Options& options = Options() ) const;
+
+    // Evaluate all the expressions against the context , the output strings
+    // are not generated until they are requested from the expansion.
+    bool Evaluate( Context* ctx ,
+                   Expansion* output ,
+                   std::string* error_description ) const;
+
+    // Evaluate again only the commands that reference one of the changed
+    // variables or functions , the string lists of the other commands are
+    // reused from the expansion. A function whose result may change must be
+    // listed as well. If the expansion is not evaluated from this template ,
+    // it is evaluated from scratch. The expansion is untouched on error.
+    bool Update( Context* ctx ,
+                 const std::vector<std::string>& changed ,
+                 Expansion* output ,
+                 std::string* error_description ) const;
+
+    // Shortcuts of Evaluate , when only the count or a slice is needed
+    bool Count( Context* ctx ,
+                std::size_t* count ,
+                std::string* error_description ) const;
+
+    bool At( Context* ctx ,
+             std::size_t index ,
+             std::string* output ,
+             std::string* error_description ) const;
+
+    bool Range( Context* ctx ,
+                std::size_t begin ,
+                std::size_t end ,
+                Sink* sink ,
+                std::string* error_description ) const;
+
+    bool IsNull() const {
+        return impl_ == NULL;
+    }
+
+private:
+    TemplateImpl* impl_;
+
+    friend bool Compile( const std::string& input ,
+                         Template* output ,
+                         std::string* error_description );
+
+    friend bool RunBatch( Context* ctx ,
+                          const std::vector<Template>& templates ,
+                          std::vector< std::vector<std::string> >* outputs ,
+                          std::string* error_description ,
+                          const Options& options );
+
+    friend class TemplateCache;
+    friend class Expansion;
+};
+
+bool Compile( const std::string& input ,
+        Template* output ,
+        std::string* error_description );
+
 bool Run( Context* ctx ,
         const std::string& input,
         std::vector<std::string>* output,
-        std::string* error_description );
+        std::string* error_description,
+        const Options& options = Options() );
+
+bool Run( Context* ctx ,
+        const std::string& input,
+        Sink* sink,
+        std::string* error_description,
+        const Options& options = Options() );
+
+bool Run( Context* ctx ,
+        const std::string& input,
+        OutputBuffer* output,
+        std::string* error_description,
+        const Options& options = Options() );
+
+// Expand many templates against one context in a single call. The string
+// pool and the evaluation buffers are reused by all the templates , and the
+// batch is always memoized as a whole : each variable is looked up and each
+// pure function is called once per argument list during the whole batch ,
+// so the context must not change its variables while the batch runs. Output
+// i is the expansion of template i. It stops at the first template that
+// fails and the error tells its index.
+bool RunBatch( Context* ctx ,
+        const std::vector<Template>& templates ,
+        std::vector< std::vector<std::string> >* outputs ,
+        std::string* error_description ,
+        const Options& options = Options() );
+
+// The inputs with the same text are compiled once and share the template
+bool RunBatch( Context* ctx ,
+        const std::vector<std::string>& inputs ,
+        std::vector< std::vector<std::string> >* outputs ,
+        std::string* error_description ,
+        const Options& options = Options() );
+
+// Compiled templates keyed by the template text , so a text that arrives
+// again is not compiled again. The memory held by the compiled templates is
+// bounded , the least recently used one is dropped first. With the thread
+// support the cache is safe to use from many threads. The templates are
+// split into shards by the hash of the text and each shard has its own lock ,
+// so threads looking up different templates rarely wait for each other.
+// The returned templates follow the Template rules above , the contexts
+// used to expand them must be thread safe on their own.
+
+class TemplateCacheImpl;
+class TemplateCache {
+public:
+    struct Stats {
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t evictions;
+        // Number of cached templates and their approximate size in bytes
+        std::size_t entries;
+        std::size_t bytes;
+
+        Stats():
+            hits(0),
+            misses(0),
+            evictions(0),
+            entries(0),
+            bytes(0)
+        {}
+    };
+
+    // Capacity is the memory in bytes that all the shards could use
+    explicit TemplateCache( std::size_t capacity = 64*1024*1024 ,
+                            unsigned int shards = 16 );
+    ~TemplateCache();
+
+    // The compiled template of the input , it is compiled and put into the
+    // cache on a miss. A compile error is never cached.
+    bool Get( const std::string& input ,
+              Template* output ,
+              std::string* error_description );
+
+    Stats GetStats() const;
+
+    // Drop all the templates , the counters are kept
+    void Clear();
+
+private:
+    TemplateCacheImpl* impl_;
+
+    TemplateCache( const TemplateCache& );
+    TemplateCache& operator = ( const TemplateCache& );
+};
 
 }// namespace tsub
 
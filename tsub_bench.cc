@@ -0,0 +1,325 @@
+// Benchmark of the template expansion. It is a self contained harness that
+// needs C++11 , build it together with the library in release mode , since
+// tsub.cc has its own test main() when NDEBUG is not defined :
+//
+//   g++ -std=c++11 -O2 -DNDEBUG tsub_bench.cc tsub.cc -o tsub_bench
+//   ./tsub_bench [name-filter]
+//
+// For each workload it reports the time per output string , the number of
+// heap allocations and bytes allocated per expansion and the peak RSS of the
+// process after the workload has run.
+
+#include "tsub.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <new>
+#include <time.h>
+#include <sys/resource.h>
+
+namespace {
+
+// Heap usage , counted by the global operator new below
+std::size_t g_alloc_count = 0;
+std::size_t g_alloc_bytes = 0;
+
+void* Allocate( std::size_t size ) {
+    ++g_alloc_count;
+    g_alloc_bytes += size;
+    void* ptr = std::malloc( size ? size : 1 );
+    if( ptr == NULL )
+        throw std::bad_alloc();
+    return ptr;
+}
+
+}// namespace
+
+void* operator new( std::size_t size ) {
+    return Allocate(size);
+}
+
+void* operator new[]( std::size_t size ) {
+    return Allocate(size);
+}
+
+void operator delete( void* ptr ) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[]( void* ptr ) noexcept {
+    std::free(ptr);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete( void* ptr , std::size_t ) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[]( void* ptr , std::size_t ) noexcept {
+    std::free(ptr);
+}
+#endif // __cpp_sized_deallocation
+
+namespace {
+
+using tsub::Value;
+using tsub::ValueList;
+
+double Now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Peak resident set size in KB
+long PeakRSS() {
+    rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+// Context with a few variables and functions , looked up by name
+class BenchContext : public tsub::Context {
+public:
+    virtual bool GetVariable( const std::string& var , Value* val ) {
+        if( var == "host" ) {
+            val->SetString("www.example.com");
+        } else if( var == "path" ) {
+            val->SetString("static/images");
+        } else if( var == "n" ) {
+            val->SetNumber(1000);
+        } else if( var == "ids" ) {
+            ValueList* list = new ValueList();
+            for( int i = 0 ; i < 64 ; ++i )
+                list->AddValue( i * 7 );
+            val->SetList(list);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    virtual bool ExecFunction( const std::string& name ,
+                               const std::vector<Value>& par ,
+                               Value* ret ,
+                               std::string* error ) {
+        if( name == "add" && par.size() == 2 &&
+            par[0].type() == Value::VALUE_NUMBER &&
+            par[1].type() == Value::VALUE_NUMBER ) {
+            ret->SetNumber( par[0].GetNumber() + par[1].GetNumber() );
+            return true;
+        } else if( name == "shard" && par.size() == 1 ) {
+            ValueList* list = new ValueList();
+            list->AddValue("a");
+            list->AddValue("b");
+            list->AddValue("c");
+            ret->SetList(list);
+            return true;
+        }
+        error->assign("unknown function");
+        return false;
+    }
+};
+
+// Mail body of about 32KB with a few commands , mostly literal text
+const char* LargeLiteral() {
+    static std::string text;
+    if( text.empty() ) {
+        for( int i = 0 ; i < 256 ; ++i ) {
+            text.append("<tr><td class=\"item\">Lorem ipsum dolor sit amet, consectetur "
+                        "adipiscing elit</td></tr>\n");
+            if( i % 64 == 0 )
+                text.append("<a href=\"http://`host`/`path`/\">`n`</a>\n");
+        }
+    }
+    return text.c_str();
+}
+
+enum {
+    OUTPUT_VECTOR,
+    OUTPUT_BUFFER,
+    // Vector output , the input is compiled through a template cache
+    OUTPUT_CACHED
+};
+
+struct Workload {
+    const char* name;
+    const char* input;
+    int output;
+    bool expect_error;
+};
+
+const Workload kWorkload[] = {
+    { "literal" ,
+      "GET /index.html HTTP/1.1\\r\\nHost: www.example.com\\r\\nUser-Agent: tsub\\r\\n"
+      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\\r\\n"
+      "Accept-Language: en-US,en;q=0.5\\r\\nConnection: keep-alive\\r\\nX-Id: `[1,2,3,4]`\\r\\n" ,
+      OUTPUT_VECTOR , false },
+    { "literal-large" , LargeLiteral() , OUTPUT_VECTOR , false },
+    { "literal-cached" , LargeLiteral() , OUTPUT_CACHED , false },
+    { "range" , "item-`[0..1000000]`" , OUTPUT_VECTOR , false },
+    { "range-buffer" , "item-`[0..1000000]`" , OUTPUT_BUFFER , false },
+    { "product" , "`[0..10]`.`[0..10]`.`[0..10]`.`[0..10]`.`[0..10]`" , OUTPUT_VECTOR , false },
+    { "product-buffer" , "`[0..10]`.`[0..10]`.`[0..10]`.`[0..10]`.`[0..10]`" , OUTPUT_BUFFER , false },
+    { "post-affine" , "`[0..200000]{$*3+7}`" , OUTPUT_VECTOR , false },
+    { "post-kernel" , "`[0..200000]{($*3+7)/2-($*$)/5}`" , OUTPUT_VECTOR , false },
+    { "post-bytecode" , "`[0..50000]{$ > 100 ? $ : \"low\"}`" , OUTPUT_VECTOR , false },
+    { "context" ,
+      "http://`host`/`path`/`shard(1)`/`add(n,1)`-`ids{add($,n)}`" , OUTPUT_VECTOR , false },
+    { "context-cached" ,
+      "http://`host`/`path`/`shard(1)`/`add(n,1)`-`ids{add($,n)}`" , OUTPUT_CACHED , false },
+    { "error-runtime" , "`[1..3]{$/0}`" , OUTPUT_VECTOR , true },
+    { "error-parse" , "`[1..3]{$+}`" , OUTPUT_VECTOR , true },
+    { NULL , NULL , 0 , false }
+};
+
+// Run the workload until it takes at least kMinTime seconds
+const double kMinTime = 0.5;
+
+bool Expand( const Workload& workload , BenchContext* context ,
+             std::vector<std::string>* vec , tsub::OutputBuffer* buffer ,
+             std::size_t* count ) {
+    std::string error;
+    bool ret;
+
+    if( workload.output == OUTPUT_BUFFER ) {
+        ret = tsub::Run(context,workload.input,buffer,&error);
+        *count = buffer->size();
+    } else if( workload.output == OUTPUT_CACHED ) {
+        static tsub::TemplateCache cache;
+        tsub::Options options;
+        options.cache = &cache;
+        ret = tsub::Run(context,workload.input,vec,&error,options);
+        *count = vec->size();
+    } else {
+        ret = tsub::Run(context,workload.input,vec,&error);
+        *count = vec->size();
+    }
+
+    if( ret == workload.expect_error ) {
+        std::fprintf(stderr,"Workload %s: unexpected result %s\n",
+            workload.name,error.c_str());
+        std::exit(1);
+    }
+    return ret;
+}
+
+// Many small templates against one context , expanded one by one with Run
+// or all together with RunBatch
+void RunBatchWorkload( bool batch ) {
+    static const char* kInput[] = {
+        "http://`host`/`path`/`[1..4]`.png" ,
+        "`host`:`add(n,80)`" ,
+        "/`path`/`shard(n)`/`ids{$+n}`" ,
+        "id-`n`-`[0..8]{$*2}`"
+    };
+    const std::size_t kSize = 200;
+
+    BenchContext context;
+    std::vector<std::string> input;
+    for( std::size_t i = 0 ; i < kSize ; ++i )
+        input.push_back( kInput[i % (sizeof(kInput)/sizeof(kInput[0]))] );
+
+    std::vector< std::vector<std::string> > output( kSize );
+    std::string error;
+    std::size_t count = 0;
+    std::size_t alloc_count = 0;
+    std::size_t alloc_bytes = 0;
+    std::size_t iteration = 0;
+    double start = 0;
+    double elapsed;
+
+    // The first round warms up
+    do {
+        if( iteration == 1 ) {
+            alloc_count = g_alloc_count;
+            alloc_bytes = g_alloc_bytes;
+            start = Now();
+        }
+
+        bool ret = true;
+        if( batch ) {
+            ret = tsub::RunBatch(&context,input,&output,&error);
+        } else {
+            for( std::size_t i = 0 ; i < kSize && ret ; ++i )
+                ret = tsub::Run(&context,input[i],&output[i],&error);
+        }
+        if( !ret ) {
+            std::fprintf(stderr,"Batch: unexpected error %s\n",error.c_str());
+            std::exit(1);
+        }
+
+        count = 0;
+        for( std::size_t i = 0 ; i < kSize ; ++i )
+            count += output[i].size();
+
+        ++iteration;
+        elapsed = Now() - start;
+    } while( iteration == 1 || elapsed < kMinTime );
+
+    --iteration;
+    std::printf("%-16s %10zu %12.2f %12.1f %14.1f %10ld\n",
+        batch ? "batch" : "batch-run",
+        count,
+        elapsed * 1e9 / (iteration * count),
+        static_cast<double>(g_alloc_count - alloc_count) / iteration,
+        static_cast<double>(g_alloc_bytes - alloc_bytes) / iteration,
+        PeakRSS());
+}
+
+void RunWorkload( const Workload& workload ) {
+    BenchContext context;
+    std::vector<std::string> vec;
+    tsub::OutputBuffer buffer('\n');
+    std::size_t count = 0;
+
+    // Warm up , so the buffers are already allocated
+    Expand(workload,&context,&vec,&buffer,&count);
+
+    std::size_t alloc_count = g_alloc_count;
+    std::size_t alloc_bytes = g_alloc_bytes;
+    std::size_t iteration = 0;
+    double start = Now();
+    double elapsed;
+
+    do {
+        Expand(workload,&context,&vec,&buffer,&count);
+        ++iteration;
+        elapsed = Now() - start;
+    } while( elapsed < kMinTime );
+
+    // Errors produce no output , the time is per expansion instead
+    std::size_t unit = workload.expect_error ? iteration : iteration * count;
+    if( unit == 0 )
+        unit = 1;
+
+    std::printf("%-16s %10zu %12.2f %12.1f %14.1f %10ld\n",
+        workload.name,
+        count,
+        elapsed * 1e9 / unit,
+        static_cast<double>(g_alloc_count - alloc_count) / iteration,
+        static_cast<double>(g_alloc_bytes - alloc_bytes) / iteration,
+        PeakRSS());
+}
+
+}// namespace
+
+int main( int argc , char** argv ) {
+    const char* filter = argc > 1 ? argv[1] : NULL;
+
+    std::printf("%-16s %10s %12s %12s %14s %10s\n",
+        "workload","outputs","ns/output","allocs/run","bytes/run","peak-KB");
+
+    for( int i = 0 ; kWorkload[i].name != NULL ; ++i ) {
+        if( filter != NULL && std::strstr(kWorkload[i].name,filter) == NULL )
+            continue;
+        RunWorkload(kWorkload[i]);
+    }
+
+    if( filter == NULL || std::strstr("batch-run",filter) != NULL ) {
+        RunBatchWorkload(false);
+        RunBatchWorkload(true);
+    }
+    return 0;
+}